@@ -0,0 +1,370 @@
+/**
+ * @file   rkana.c
+ * @data   2026-10-19
+ * @author Benjamin Gerard
+ * @brief  Output analysis (peak, loudness, hash)
+ *
+ * ----------------------------------------------------------------------
+ *
+ * MIT License
+ *
+ * Copyright (c) 2018 Benjamin Gerard AKA Ben^OVR.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "rkplay.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+enum {
+  TP_TAPS  = 12,			/* taps per true-peak phase */
+  TP_PHASE = 4,				/* true-peak oversampling */
+  TP_CHUNK = 256,			/* frames per true-peak pass */
+  HASH_LANES = 4
+};
+
+/* Biquad (direct form I). */
+typedef struct {
+  double b0, b1, b2, a1, a2;
+  double x1[2], x2[2], y1[2], y2[2];
+} kbiq_t;
+
+struct rkana {
+  unsigned spr;
+  unsigned long frames;			/* frames analyzed */
+  unsigned long clips;			/* samples at full scale */
+  int	   peak;			/* sample peak */
+  float	   tpeak;			/* true-peak (oversampled) */
+  double   sqr;				/* sum of squares (RMS) */
+
+  /* True-peak interpolator (history then chunk) */
+  float	   tph[TP_PHASE-1][TP_TAPS];
+  float	   tpg;				/* max gain of a phase */
+  float	   tpx[2][TP_TAPS-1+TP_CHUNK];
+
+  /* K-weighting and 100ms loudness sub-blocks */
+  kbiq_t   kw[2];
+  unsigned blklen, blkpos;
+  double   blksum;
+  double * blk;
+  unsigned nblk, maxblk;
+
+  /* Content hash */
+  uint64_t hash[HASH_LANES];
+};
+
+/* K-weighting filter stages (ITU-R BS.1770) for any sampling rate. */
+static void
+kw_setup(kbiq_t * B, double spr)
+{
+  double f0 = 1681.974450955533, G = 3.999843853973347;
+  double Q = 0.7071752369554196, K, Vh, Vb, a0;
+
+  memset(B, 0, 2*sizeof(*B));
+
+  /* High shelf */
+  K  = tan(M_PI * f0 / spr);
+  Vh = pow(10.0, G / 20.0);
+  Vb = pow(Vh, 0.4996667741545416);
+  a0 = 1.0 + K / Q + K * K;
+  B[0].b0 = (Vh + Vb * K / Q + K * K) / a0;
+  B[0].b1 = 2.0 * (K * K - Vh) / a0;
+  B[0].b2 = (Vh - Vb * K / Q + K * K) / a0;
+  B[0].a1 = 2.0 * (K * K - 1.0) / a0;
+  B[0].a2 = (1.0 - K / Q + K * K) / a0;
+
+  /* RLB high-pass */
+  f0 = 38.13547087602444;
+  Q  = 0.5003270373238773;
+  K  = tan(M_PI * f0 / spr);
+  a0 = 1.0 + K / Q + K * K;
+  B[1].b0 = 1.0;
+  B[1].b1 = -2.0;
+  B[1].b2 = 1.0;
+  B[1].a1 = 2.0 * (K * K - 1.0) / a0;
+  B[1].a2 = (1.0 - K / Q + K * K) / a0;
+}
+
+static inline double
+kw_run(kbiq_t * B, int c, double x)
+{
+  const double y = B->b0 * x + B->b1 * B->x1[c] + B->b2 * B->x2[c]
+    - B->a1 * B->y1[c] - B->a2 * B->y2[c];
+  B->x2[c] = B->x1[c];
+  B->x1[c] = x;
+  B->y2[c] = B->y1[c];
+  B->y1[c] = y;
+  return y;
+}
+
+/* Windowed sinc interpolator. Phase 0 is the sample itself so only
+ * the in-between phases are kept.
+ */
+static void
+tp_setup(rkana_t * A)
+{
+  const int len = TP_TAPS * TP_PHASE, mid = len / 2;
+  int p, k;
+
+  for (p=1; p<TP_PHASE; ++p)
+    for (k=0; k<TP_TAPS; ++k) {
+      const int n = k * TP_PHASE + p;
+      const double x = (double) (n - mid) / TP_PHASE;
+      const double w = 0.5 + 0.5 * cos(M_PI * (n - mid) / mid);
+      A->tph[p-1][TP_TAPS-1-k] = w * sin(M_PI * x) / (M_PI * x);
+    }
+
+  for (p=0; p<TP_PHASE-1; ++p) {
+    float g = 0;
+    for (k=0; k<TP_TAPS; ++k)
+      g += fabsf(A->tph[p][k]);
+    if (g > A->tpg)
+      A->tpg = g;
+  }
+}
+
+rkana_t * rk_ana_new(int spr)
+{
+  rkana_t * A;
+  int i;
+
+  if (spr < 1000)
+    return 0;
+  A = calloc(1, sizeof(*A));
+  if (!A)
+    return 0;
+  A->spr = spr;
+  A->blklen = (spr + 5) / 10;
+  kw_setup(A->kw, spr);
+  tp_setup(A);
+  for (i=0; i<HASH_LANES; ++i)
+    A->hash[i] = 0xCBF29CE484222325ull + i;
+  return A;
+}
+
+void rk_ana_free(rkana_t * A)
+{
+  if (A) {
+    free(A->blk);
+    free(A);
+  }
+}
+
+/* Peak, clips and sum of squares. Kept apart from the recursive
+ * stages so that the compiler can vectorize it.
+ */
+static void
+ana_level(rkana_t * A, const int16_t * pcm, int n)
+{
+  int i, peak = A->peak;
+  unsigned long clips = 0;
+  int64_t sqr = 0;
+
+  for (i=0; i<n; ++i) {
+    const int v = pcm[i], a = v < 0 ? -v : v;
+    peak   = a > peak ? a : peak;
+    clips += a >= 32767;
+    sqr   += v * v;
+  }
+  A->peak   = peak;
+  A->clips += clips;
+  A->sqr   += sqr;
+}
+
+/* FNV-1a on 32-bit frames, interleaved on 4 lanes. */
+static void
+ana_hash(rkana_t * A, const int16_t * pcm, int n)
+{
+  uint64_t h[HASH_LANES];
+  int i, l = A->frames & (HASH_LANES-1);
+
+  memcpy(h, A->hash, sizeof(h));
+  for (i=0; i<n; ++i, l=(l+1)&(HASH_LANES-1)) {
+    const uint32_t f =
+      (uint16_t) pcm[2*i] | (uint32_t) (uint16_t) pcm[2*i+1] << 16;
+    h[l] = (h[l] ^ f) * 0x100000001B3ull;
+  }
+  memcpy(A->hash, h, sizeof(h));
+}
+
+/* Store the mean square of a 100ms sub-block. Blocks are dropped
+ * (loudness is then partial) if memory is exhausted.
+ */
+static void
+ana_block(rkana_t * A, double e)
+{
+  if (A->nblk == A->maxblk) {
+    const unsigned max = A->maxblk ? A->maxblk*2 : 1024;
+    double * blk = realloc(A->blk, max * sizeof(*blk));
+    if (!blk)
+      return;
+    A->blk = blk;
+    A->maxblk = max;
+  }
+  A->blk[A->nblk++] = e;
+}
+
+/* Interpolate a chunk of one channel. The loops run over time so
+ * that they vectorize. The chunk is skipped when even its loudest
+ * sample can not beat the current true-peak.
+ */
+static void
+ana_tpeak(rkana_t * A, const int16_t * pcm, int n, int c)
+{
+  float * const x = A->tpx[c];
+  float acc[TP_CHUNK], peak = A->tpeak, max = 0;
+  int i, p, k;
+
+  for (i=0; i<n; ++i)
+    x[TP_TAPS-1+i] = pcm[2*i+c];
+  for (i=0; i<TP_TAPS-1+n; ++i) {
+    const float a = fabsf(x[i]);
+    max = a > max ? a : max;
+  }
+
+  for (p=0; p<TP_PHASE-1 && max * A->tpg > peak; ++p) {
+    for (i=0; i<n; ++i)
+      acc[i] = 0;
+    for (k=0; k<TP_TAPS; ++k) {
+      const float h = A->tph[p][k];
+      for (i=0; i<n; ++i)
+	acc[i] += h * x[i+k];
+    }
+    for (i=0; i<n; ++i) {
+      const float a = fabsf(acc[i]);
+      peak = a > peak ? a : peak;
+    }
+  }
+  A->tpeak = peak;
+  memmove(x, x+n, (TP_TAPS-1)*sizeof(*x));
+}
+
+/* K-weighted energy in 100ms sub-blocks. */
+static void
+ana_loud(rkana_t * A, const int16_t * pcm, int n)
+{
+  kbiq_t kw[2];
+  double sum = A->blksum;
+  unsigned pos = A->blkpos;
+  int i;
+
+  memcpy(kw, A->kw, sizeof(kw));
+  for (i=0; i<n; ++i) {
+    const double l = kw_run(kw+1, 0, kw_run(kw, 0, pcm[2*i+0]));
+    const double r = kw_run(kw+1, 1, kw_run(kw, 1, pcm[2*i+1]));
+
+    sum += l * l + r * r;
+    if (++pos == A->blklen) {
+      ana_block(A, sum / (32768.0 * 32768.0 * A->blklen));
+      sum = 0;
+      pos = 0;
+    }
+  }
+  memcpy(A->kw, kw, sizeof(kw));
+  A->blksum = sum;
+  A->blkpos = pos;
+}
+
+void rk_ana_run(rkana_t * A, const void * mix, int n)
+{
+  const int16_t * pcm = mix;
+
+  ana_level(A, pcm, n*2);
+  ana_hash(A, pcm, n);
+  ana_loud(A, pcm, n);
+  A->frames += n;
+
+  while (n > 0) {
+    const int m = n < TP_CHUNK ? n : TP_CHUNK;
+    ana_tpeak(A, pcm, m, 0);
+    ana_tpeak(A, pcm, m, 1);
+    pcm += 2*m;
+    n -= m;
+  }
+}
+
+static double
+lufs(double e)
+{
+  return e > 0 ? -0.691 + 10.0 * log10(e) : -HUGE_VAL;
+}
+
+static double
+dbfs(double v)
+{
+  return v > 0 ? 20.0 * log10(v / 32768.0) : -HUGE_VAL;
+}
+
+/* Gated integrated loudness (EBU R128): 400ms blocks overlapping by
+ * 75%, absolute gate at -70 LUFS then relative gate at -10 LU.
+ */
+static double
+ana_loudness(const rkana_t * A)
+{
+  const double abs_gate = -70.0;
+  double sum, rel_gate;
+  unsigned i, n;
+  int pass;
+
+  /* The first pass has no relative gate yet */
+  for (pass=0, rel_gate=abs_gate; pass<2; ++pass) {
+    for (i=n=0, sum=0; i+4 <= A->nblk; ++i) {
+      const double e = ( A->blk[i] + A->blk[i+1] +
+			 A->blk[i+2] + A->blk[i+3] ) / 4.0;
+      const double z = lufs(e);
+      if (z > abs_gate && z > rel_gate) {
+	sum += e;
+	++n;
+      }
+    }
+    if (!n)
+      return -HUGE_VAL;
+    rel_gate = lufs(sum / n) - 10.0;
+  }
+  return lufs(sum / n);
+}
+
+void rk_ana_result(const rkana_t * A, rkres_t * R)
+{
+  uint64_t h = 0;
+  int i;
+
+  memset(R, 0, sizeof(*R));
+  R->frames = A->frames;
+  R->clips  = A->clips;
+  R->peak   = dbfs(A->peak);
+  R->tpeak  = dbfs(A->tpeak > A->peak ? A->tpeak : A->peak);
+  R->rms    = A->frames ? dbfs(sqrt(A->sqr / (A->frames * 2.0))) : -HUGE_VAL;
+  R->lufs   = ana_loudness(A);
+  R->rgain  = -18.0 - R->lufs;
+  for (i=0; i<HASH_LANES; ++i)
+    h = (h ^ A->hash[i]) * 0x100000001B3ull;
+  R->hash = h;
+}
@@ -34,6 +34,12 @@
 #include "rkplay.h"
 #include "rkpriv.h"
 #include <string.h>
+#include <math.h>
+#include <float.h>
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
 
 // GB: XXX DEBUG
 #include <stdio.h>
@@ -43,9 +49,13 @@ const char * rk_version(void)
   return "rkplay " VERSION;
 }
 
-int rk_sizeof(void)
+/* Size of a player of module M: its SID bank follows it. */
+int rk_sizeof(const rkmod_t * M)
 {
-  return sizeof(rkpla_t);
+  const int off = (intptr_t)(((rkpla_t*)0)->sbk);
+  const int siz = off + M->sbkLen * sizeof(int16_t);
+
+  return siz > (int) sizeof(rkpla_t) ? siz : (int) sizeof(rkpla_t);
 }
 
 /* ----------------------------------------------------------------------
@@ -90,18 +100,153 @@ period(int not, int tra,  int arp)
   return Tper[ note ];
 }
 
+/* ----------------------------------------------------------------------
+ *  Event trace
+ * ---------------------------------------------------------------------- */
+
+#ifndef RK_NO_TRACE
+
+/* Events are dropped when the ring is full so that the player never
+ * waits for the consumer.
+ */
+static void
+trace_push(rkpla_t * const P, const rkchn_t * const C,
+	   int typ, int arg1, int arg2)
+{
+  rktrc_t * const T = &P->trc;
+  const uint32_t wr = T->wr;
+
+  if (wr - __atomic_load_n(&T->rd, __ATOMIC_ACQUIRE) <= T->msk) {
+    rkevt_t * const E = T->buf + (wr & T->msk);
+    E->tic  = P->tic;
+    E->frm  = P->frm;
+    E->chn  = C->num;
+    E->typ  = typ;
+    E->arg1 = arg1;
+    E->arg2 = arg2;
+    __atomic_store_n(&T->wr, wr+1, __ATOMIC_RELEASE);
+  }
+}
+
+# define TRACE(P,C,TYP,A1,A2)					\
+  if (!(P)->trc.buf); else trace_push(P,C,TYP,A1,A2)
+
+#else
+
+# define TRACE(P,C,TYP,A1,A2) (void)0
+
+#endif
+
+int rk_trace(rkpla_t * const P, rkevt_t * buf, int size)
+{
+#ifndef RK_NO_TRACE
+  if (buf && (size < 2 || (size & (size-1))))
+    return -1;
+  P->trc.buf = 0;
+  P->trc.msk = size-1;
+  P->trc.wr  = P->trc.rd = 0;
+  P->trc.buf = buf;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int rk_trace_read(rkpla_t * const P, rkevt_t * evt, int max)
+{
+  rktrc_t * const T = &P->trc;
+  const uint32_t rd = T->rd;
+  const uint32_t wr = __atomic_load_n(&T->wr, __ATOMIC_ACQUIRE);
+  int n;
+
+  if (!T->buf)
+    return 0;
+  for (n=0; n<max && rd+n != wr; ++n)
+    evt[n] = T->buf[(rd+n) & T->msk];
+  __atomic_store_n(&T->rd, rd+n, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* ----------------------------------------------------------------------
+ *  Sample bank
+ * ---------------------------------------------------------------------- */
+
+/* The mixers read the instrument samples widened to 16-bit from the
+ * bank. Each one is followed by RKBNKPAD guard samples (the start of
+ * the loop or silence) so that the interpolators can read past its
+ * end without testing for it.
+ *
+ * The module bank is never altered. The samples a SID alters are
+ * stored last; each player copies them to its own SID bank (sbk)
+ * where its SID writes.
+ */
+static void
+bank_guard(int16_t * const bnk, const rkins_t * const I)
+{
+  const int len = I->len;
+  int i;
+
+  for (i=0; i<RKBNKPAD; ++i)
+    bnk[len+i] = I->loop && len > 0 ? bnk[i % len] : 0;
+}
+
+/* Copy the sample of I to the bank at BNK. Returns the bank position
+ * following it.
+ */
+static u32_t
+bank_fill(rkmod_t * const M, rkins_t * const I, u32_t bnk)
+{
+  const int8_t * const pcm = (const int8_t *) M->raw + I->pcm;
+  u32_t i;
+
+  I->bnk = bnk;
+  I->lvMin = I->lvMax = 0;
+  I->lvSqr = 0;
+  for (i=0; i<I->len; ++i) {
+    M->bnk[I->bnk+i] = pcm[i];
+    if (pcm[i] < I->lvMin)
+      I->lvMin = pcm[i];
+    else if (pcm[i] > I->lvMax)
+      I->lvMax = pcm[i];
+    I->lvSqr += pcm[i] * pcm[i];
+  }
+  bank_guard(M->bnk + I->bnk, I);
+  return bnk + RKBNKSEG(I->len);
+}
+
+/* Write the SID sample byte V at module offset OFF to the player SID
+ * bank.
+ */
+static void
+bank_poke(rkpla_t * const P, u32_t off, int8_t v)
+{
+  const rkmod_t * const M = P->mod;
+  int k;
+
+  for (k=0; k<M->nbi; ++k) {
+    const rkins_t * const I = &M->ins[k];
+    if (I->sb && off >= I->pcm && off < I->pcm + I->len) {
+      P->sbk[I->sbk + off - I->pcm] = v;
+      if (I->loop && off < I->pcm + RKBNKPAD)
+	bank_guard(P->sbk + I->sbk, I);
+    }
+  }
+}
+
 /* ----------------------------------------------------------------------
  *  Init
  * ---------------------------------------------------------------------- */
 
+/* Decode instrument NUM. */
 static void
-init_inst(rkpla_t * P, rkf_ins_t * idef, uint8_t num)
+init_inst(rkmod_t * M, const rkf_ins_t * idef, uint8_t num)
 {
   int k;
-  rkins_t * I = &P->ins[num];
+  rkins_t * I = &M->ins[num];
   rkf_spl_t * def;
-  u32_t len;
+  int8_t * pcm;
 
+  memset(I, 0, sizeof(*I));
   I->num = num;
 
   /* Get sample info */
@@ -115,9 +260,9 @@ init_inst(rkpla_t * P, rkf_ins_t * idef, uint8_t num)
   /* SID */
   I->sidSpd = U8(idef->sidSpd);
   I->sidLen = U8(idef->sidLen);
-  I->sidPcm = U8(idef->sidPcm);
-  I->sidAlt = U8(idef->sidAlt);
-  I->sidPos = U8(idef->sidPos);
+  I->sid.pcm = U8(idef->sidPcm);
+  I->sid.alt = U8(idef->sidAlt);
+  I->sid.pos = U8(idef->sidPos);
 
   /* ADSR info */
   for ( k=0; k<4; ++k ) {
@@ -126,21 +271,17 @@ init_inst(rkpla_t * P, rkf_ins_t * idef, uint8_t num)
   }
 
   /* PCM info */
-  I->pcmAdr = self(def->todat);
-  assert( I->pcmAdr );
-  len = U16(def->len) << 1;
+  pcm = self(def->todat);
+  assert( pcm );
+  I->pcm = (uint8_t *) pcm - M->raw;
+  I->len = U16(def->len) << 1;
   I->sidBas = U16(def->sid);	      /* SID mid point or something */
-
-  I->pcmEnd = I->pcmAdr + len;
-  if (!U8(idef->one)) {
-    I->lpAdr = I->pcmAdr;
-    I->lpEnd = I->pcmEnd;
-  }
+  I->loop = !U8(idef->one);
 
   /* Vibrato info */
   def = self(idef->tovib);
   if (def) {
-    I->vibDat = self(def->todat);
+    I->vib = (uint8_t *) self(def->todat) - M->raw;
     I->vibLen = U16(def->len) << 1;
     I->vibW8t = U8(idef->vibW8t);
     I->vibAmp = U8(idef->vibAmp);
@@ -149,70 +290,190 @@ init_inst(rkpla_t * P, rkf_ins_t * idef, uint8_t num)
   }
 }
 
-int rk_init(rkpla_t * const P, rkmod_t * const M, int num)
+/* Decode the instruments of M and fill its sample bank (rk_load()). */
+void rk_decode_inst(rkmod_t * const M)
 {
-  uint8_t * song;
-  rkf_ins_t * idef;
+  const rkf_ins_t * idef = (const rkf_ins_t *) M->_ins;
+  u32_t bnk = 0;
+  int j, k;
+
+  assert( M->nbi <= RKMAXINST );
+  memset(M->ins, 0, sizeof(M->ins));
+  for (k=0; k<M->nbi; ++k, ++idef)
+    init_inst(M, idef, k);
+
+  /* Samples overlapping the bytes a SID writes */
+  for (j=0; j<M->nbi; ++j) {
+    const rkins_t * const I = &M->ins[j];
+    const u32_t lo = I->pcm + I->sidBas - I->sidLen;
+    const u32_t hi = lo + I->sidLen*2;
+
+    if (!I->pcm || !I->sidSpd)
+      continue;
+    for (k=0; k<M->nbi; ++k) {
+      rkins_t * const J = &M->ins[k];
+      if (J->pcm && lo < J->pcm + J->len && hi >= J->pcm)
+	J->sb = 1;
+    }
+  }
+
+  for (k=0; k<M->nbi; ++k)
+    if (M->ins[k].pcm && !M->ins[k].sb)
+      bnk = bank_fill(M, M->ins+k, bnk);
+  M->sbkOff = bnk;
+  for (k=0; k<M->nbi; ++k)
+    if (M->ins[k].sb) {
+      M->ins[k].sbk = bnk - M->sbkOff;
+      bnk = bank_fill(M, M->ins+k, bnk);
+    }
+  M->sbkLen = bnk - M->sbkOff;
+  assert( bnk <= M->bnkLen );
+}
+
+/* Reset the SID state of the player and its copy of the samples the
+ * SID alters. Nothing else is shared with the other players.
+ */
+static void
+init_sids(rkpla_t * P)
+{
+  const rkmod_t * const M = P->mod;
   int k;
-  const int maxins = sizeof(P->ins) / sizeof(*P->ins);
 
-  if (!P || !M || num < 1 || num > M->nbs)
+  for (k=0; k<M->nbi; ++k)
+    P->sid[k] = M->ins[k].sid;
+  memcpy(P->sbk, M->bnk + M->sbkOff, M->sbkLen * sizeof(*P->sbk));
+}
+
+/* Setup the channels to start song NUM. */
+static void
+init_song(rkpla_t * P, int num)
+{
+  uint8_t * song = (uint8_t*) P->mod->_sng + (num-1)*8;
+  int k;
+
+  P->num = num;
+  for ( k=0; k<4; ++k, song+=2 ) {
+    rkchn_t * C = &P->chn[k];
+
+    memset(C,0,sizeof(*C));
+    C->num    = k;
+    C->msk    = 0x111 << k;
+    C->sngAdr = (uint8_t *) self(song) - P->raw;
+    C->seqPtr = 0;		/* Trigger a new sequence read */
+    C->sngPtr = C->sngAdr-4;	/* -4 because it's post incremented */
+    C->seqRep = 1;
+    C->arpAdr = P->mod->_arp - P->raw;
+    C->curIns = 0;
+    C->seqW8t = 1;
+  }
+}
+
+/* Init the player P (rk_sizeof(M) bytes) to play song NUM of M. */
+int rk_init(rkpla_t * const P, rkmod_t * const M, int num)
+{
+  if (!P || !M || !M->bnk || num < 1 || num > M->nbs)
     return -1;
 
   memset(P,0,sizeof(*P));
 
   /* Copy mod info */
   P->mod = M;
-  P->arp = (rkarp_t*)M->_arp;
+  P->raw = M->raw;
   P->frq = M->frq;
   /* P->end = 0; */
   /* P->tic = 0; */
-  P->num = num;
+  P->mix.gain = 0x100;
 
-  /* Init instruments */
-  assert( M->nbi <= maxins );
-  idef = (rkf_ins_t *) M->_ins;
-  for (k=0; k<M->nbi; ++k, ++idef)
-    init_inst(P, idef, k);
-  /* memset(P->ins+k, 0, (maxins-k)*sizeof(*P->ins)); */
+  /* SID state and samples */
+  init_sids(P);
 
   /* Init song and sequences */
-  song = (uint8_t*) M->_sng + (num-1)*8;
-  for ( k=0; k<4; ++k, song+=2 ) {
-    static uint8_t ff = 0xff;
-    rkchn_t * C = &P->chn[k];
+  init_song(P, num);
 
-    /* memset(C,0,sizeof(*C)); */
-    C->num    = k;
-    C->msk    = 0x111 << k;
-    C->sngAdr = self(song);
-    C->seqPtr = &ff;		/* Trigger a new sequence read */
-    C->sngPtr = C->sngAdr-4;	/* -4 because it's post incremented */
-    C->seqRep = 1;
-    C->arpAdr = P->arp[0];
-    C->curIns = P->ins;
-    C->seqW8t = 1;
-  }
+  return P->frq;
+}
+
+/* Make D a copy of S playing module M, S's module or a copy of it
+ * (see rk_mod_dup()). The trace, the statistics and the loop
+ * detection buffer are not copied. The player only holds offsets in
+ * its module so that nothing has to be relocated. D is rk_sizeof(M)
+ * bytes.
+ */
+int rk_clone(rkpla_t * const D, const rkpla_t * const S, rkmod_t * const M)
+{
+  if (!D || !S || !M || !M->bnk || M->siz != S->mod->siz ||
+      M->bnkLen != S->mod->bnkLen || M->sbkLen != S->mod->sbkLen)
+    return -1;
+
+  *D = *S;
+  memcpy(D->sbk, S->sbk, M->sbkLen * sizeof(*D->sbk));
+  D->mod = M;
+  D->raw = M->raw;
+  D->sts = 0;
+  D->wrp = 0;
+  memset(&D->trc, 0, sizeof(D->trc));
+  return 0;
+}
+
+/* Restart with song NUM. The mixer settings, the ignored channels and
+ * the trace are kept; the SID state and samples are reset.
+ */
+int rk_select_song(rkpla_t * const P, int num)
+{
+  const rkmod_t * const M = P ? P->mod : 0;
+
+  if (!M || num < 1 || num > M->nbs)
+    return -1;
+
+  init_sids(P);
+  if (P->sts)
+    memset(P->sts, 0, rk_stats_sizeof());
+
+  P->evt = P->tic = P->frm = 0;
+  P->err = 0;
+  P->nwrap = P->lpTic = P->lpLen = 0;
+  if (P->wrp)
+    memset(P->wrp, 0, rk_loop_sizeof());
+  memset(&P->mix.voc, 0, sizeof(P->mix.voc));
+  init_song(P, num);
 
   return P->frq;
 }
 
-static void
-trigr_sample(rkchn_t * const C)
+int rk_stats_sizeof(void)
 {
-  assert( C->curIns->pcmAdr );
-  C->voice.pcm	 = C->curIns->pcmAdr;
-  C->voice.end	 = C->curIns->pcmEnd;
-  C->voice.lpadr = C->curIns->lpAdr;
-  C->voice.lpend = C->curIns->lpEnd;
-  C->voice.acu	 = 0;
+  return RKMAXINST * 4 * sizeof(rkstat_t);
+}
 
+/* Collect the instrument statistics of the own mixer in BUF
+ * (rk_stats_sizeof() bytes), 0 to stop.
+ */
+int rk_stats(rkpla_t * const P, void * buf)
+{
+  P->sts = buf;
+  if (buf)
+    memset(buf, 0, rk_stats_sizeof());
+  return 0;
+}
+
+/* The voices belong to the mixers. They restart the sample of the
+ * triggered channels at the beginning of the next mix.
+ */
+static void
+trigr_sample(const rkpla_t * const P, rkchn_t * const C)
+{
+  (void) P;				/* only asserted */
+  assert( P->mod->ins[C->curIns].pcm );
   C->trg = 1;
 }
 
 static void
 seq_read(rkpla_t * P, rkchn_t * C)
 {
+  static const uint8_t ff = 0xff;
+  uint8_t * const raw = P->raw;
+  const uint8_t * seq = C->seqPtr ? raw + C->seqPtr : &ff;
+  const uint8_t * sng = raw + C->sngPtr;
   int bit = 0;
   assert( ! C->seqW8t );
 
@@ -220,56 +481,59 @@ seq_read(rkpla_t * P, rkchn_t * C)
 
   for (;;) {
 
-    if ( C->seqPtr[0] == 0x80 ) {
+    if ( seq[0] == 0x80 ) {
       /* Arpeggios 0x80,NUM */
-      C->arpAdr = P->arp[C->seqPtr[1]];
+      C->arpAdr = P->mod->_arp - raw + seq[1] * sizeof(rkarp_t);
       C->arpIdx = 0;
-      C->seqPtr += 2;
+      TRACE(P, C, RK_EVT_ARPEGGIO, seq[1], 0);
+      seq += 2;
     }
 
-    if ( C->seqPtr[0] == 0x81 ) {
+    if ( seq[0] == 0x81 ) {
       /* Portamento 0x81,GOAL,SPEED,WAIT */
       C->envIdx = 0;			/* !!! Note trigger */
-      C->ptaNot = C->seqPtr[1];		/* Goal note */
+      C->ptaNot = seq[1];		/* Goal note */
       C->ptaPer = period(C->ptaNot, C->seqTra, 0);
-      C->ptaStp = C->seqPtr[2];
-      C->seqW8t = C->seqPtr[3] << 2;
+      C->ptaStp = seq[2];
+      C->seqW8t = seq[3] << 2;
       assert( C->seqW8t );
-      C->seqPtr += 4;
+      TRACE(P, C, RK_EVT_PORTAMENTO, C->ptaNot, C->ptaStp);
+      seq += 4;
       break;
     }
 
-    if ( C->seqPtr[0] == 0x82 ) {
+    if ( seq[0] == 0x82 ) {
       /* Set instrument */
       C->curVol = 0;
       C->envIdx = 0;			/* Reset ADSR */
-      C->curIns = P->ins + C->seqPtr[1];
-      trigr_sample(C);
+      C->curIns = seq[1];
+      trigr_sample(P, C);
+      TRACE(P, C, RK_EVT_INST, seq[1], 0);
 
-      C->seqPtr += 2;
+      seq += 2;
     }
 
-    if ( C->seqPtr[0] == 0x83 ) {
+    if ( seq[0] == 0x83 ) {
       assert(!"unsupported command 0x83");
       P->err = 0x83;
-      C->seqPtr = 0;
+      seq = 0;
       break;
     }
 
-    if ( C->seqPtr[0] == 0x84 ) {
+    if ( seq[0] == 0x84 ) {
       /* Envelop speed 0x84,PAR  */
-      C->envSpd = C->seqPtr[1];
-      C->seqPtr += 2;
+      C->envSpd = seq[1];
+      seq += 2;
     }
 
-    if ( C->seqPtr[0] == 0x85 ) {
+    if ( seq[0] == 0x85 ) {
       assert(!"unsupported command 0x85");
       P->err = 0x85;
-      C->seqPtr = 0;
+      seq = 0;
       break;
     }
 
-    if ( C->seqPtr[0] & 0x80 ) {
+    if ( seq[0] & 0x80 ) {
       /* GB: Normally sequences end with 0xFF however the original
        * replay only test the MSB. It happens (in Title) that indeed
        * the byte at this point is not 0xFF (but 0x80). While I
@@ -279,27 +543,30 @@ seq_read(rkpla_t * P, rkchn_t * C)
        * with 0xFF but keep the code working with the unmodified data.
        */
 
-      /* if ( C->seqPtr[0] != 0xFF ) { */
+      /* if ( seq[0] != 0xFF ) { */
       /*   printf("%c@%05u CMD $%02x instead of $FF\n", */
-      /*          'A'+C->num, P->tic, C->seqPtr[0] ); */
+      /*          'A'+C->num, P->tic, seq[0] ); */
       /* } */
-      assert ( C->seqPtr[0] == 0xFF );
+      assert ( seq[0] == 0xFF );
 
       if ( -- C->seqRep ) {
-	C->seqPtr = self(C->sngPtr);
-	C->seqTra = C->sngPtr[2];
+	seq = self(sng);
+	C->seqTra = sng[2];
 	P->evt |= 0xF00 & C->msk;
+	TRACE(P, C, RK_EVT_SEQUENCE, C->seqRep, 0);
       } else {
-	C->sngPtr += 4;
-	C->seqPtr = self(C->sngPtr);
-	if (!C->seqPtr) {
-	  C->seqPtr = self(C->sngPtr = C->sngAdr);
+	sng += 4;
+	seq = self(sng);
+	if (!seq) {
+	  seq = self(sng = raw + C->sngAdr);
 	  if ( ! (0x00F & P->evt & C->msk) )
 	    C->ticLen = P->tic - 1;
 	  P->evt |= 0x0FF & C->msk;
+	  TRACE(P, C, RK_EVT_SONGWRAP, 0, 0);
 	}
-	C->seqTra = C->sngPtr[2];
-	C->seqRep = C->sngPtr[3];
+	C->seqTra = sng[2];
+	C->seqRep = sng[3];
+	TRACE(P, C, RK_EVT_SEQUENCE, C->seqRep, 0);
       }
 
       bit = 0;
@@ -307,12 +574,13 @@ seq_read(rkpla_t * P, rkchn_t * C)
     } else {
       i16_t w8t;
 
-      C->seqNot = C->seqPtr[0];
-      w8t = C->seqPtr[1];
-      C->seqPtr += 2;
+      C->seqNot = seq[0];
+      w8t = seq[1];
+      seq += 2;
       C->curPer = period(C->seqNot, C->seqTra, 0);
       if (w8t) {
-	trigr_sample(C);
+	trigr_sample(P, C);
+	TRACE(P, C, RK_EVT_NOTE, C->seqNot, C->curIns);
 	C->seqW8t = w8t << 2;
 	assert( C->seqW8t );
 	C->envIdx = 0;
@@ -321,43 +589,41 @@ seq_read(rkpla_t * P, rkchn_t * C)
       }
     }
   }
+  C->seqPtr = seq ? seq - raw : 0;
+  C->sngPtr = sng - raw;
   assert ( C->seqW8t );
 
   C->vibIdx = 0;
-  if (C->curIns->vibW8t)
-    C->vibW8t = (C->curIns->vibW8t << 2) - 1;
+  if (P->mod->ins[C->curIns].vibW8t)
+    C->vibW8t = (P->mod->ins[C->curIns].vibW8t << 2) - 1;
 }
 
 static void
-do_asid(rkchn_t * const C)
+do_asid(rkpla_t * const P, rkchn_t * const C)
 {
-  rkins_t * const I = C->curIns;
+  const rkins_t * const I = &P->mod->ins[C->curIns];
+  rksid_t * const S = &P->sid[C->curIns];
 
   if (I->sidSpd) {
     if (C->sidW8t)
       --C->sidW8t;
     else {
-      int8_t * pcm;
+      const int off = (int) I->pcm + I->sidBas - I->sidLen + S->pos;
 
       C->sidW8t = I->sidSpd - 1;
 
-      pcm  = I->pcmAdr;
-      pcm += I->sidBas;
-      pcm -= I->sidLen;
-
-      assert (I->sidPos >= 0 && I->sidPos <= I->sidLen*2);
+      assert (S->pos >= 0 && S->pos <= I->sidLen*2);
 
-      if(!I->sidAlt) {
-	pcm[I->sidPos] = I->sidPcm;
-	if (++I->sidPos == I->sidLen*2) {
-	  I->sidAlt = ~I->sidAlt;
-	  I->sidPcm = ~I->sidPcm;
+      bank_poke(P, off, S->pcm);
+      if(!S->alt) {
+	if (++S->pos == I->sidLen*2) {
+	  S->alt = ~S->alt;
+	  S->pcm = ~S->pcm;
 	}
       } else {
-	pcm[I->sidPos] = I->sidPcm;
-	if (--I->sidPos == 0) {
-	  I->sidAlt = ~I->sidAlt;
-	  I->sidPcm = ~I->sidPcm;
+	if (--S->pos == 0) {
+	  S->alt = ~S->alt;
+	  S->pcm = ~S->pcm;
 	}
       }
     }
@@ -365,11 +631,11 @@ do_asid(rkchn_t * const C)
 }
 
 static i16_t
-do_arpeggio(rkchn_t * const C)
+do_arpeggio(const rkpla_t * const P, rkchn_t * const C)
 {
   i16_t per;
   assert( C->arpAdr && C->arpIdx >= 0 && C->arpIdx < 12);
-  per = period( C->seqNot, C->seqTra, C->arpAdr[ C->arpIdx ] );
+  per = period( C->seqNot, C->seqTra, P->raw[ C->arpAdr + C->arpIdx ] );
   if ( --C->arpIdx < 0 )
     C->arpIdx = 11;
   return per;
@@ -393,21 +659,20 @@ do_portamento(rkchn_t * const C)
 }
 
 static i16_t
-do_vibrato(rkchn_t * const C)
+do_vibrato(const rkpla_t * const P, rkchn_t * const C)
 {
+  const rkins_t * const I = &P->mod->ins[C->curIns];
   i16_t per = 0;
 
-  if ( C->curIns->vibSpd ) {
+  if ( I->vibSpd ) {
     if (C->vibW8t > 0)
       --C->vibW8t;
     else {
-      const rkins_t * const I = C->curIns;
-
       assert( I->vibLen > 2 );
-      assert( I->vibDat );
+      assert( I->vib );
       assert( C->vibIdx >= 0 && C->vibIdx < I->vibLen );
 
-      per = I->vibDat[C->vibIdx] * I->vibAmp;
+      per = (int8_t) P->raw[I->vib + C->vibIdx] * I->vibAmp;
       C->vibIdx -= I->vibSpd;
       if (C->vibIdx < 0)
 	C->vibIdx += I->vibLen;
@@ -417,23 +682,24 @@ do_vibrato(rkchn_t * const C)
 }
 
 static i16_t
-do_period(rkchn_t * const C)
+do_period(const rkpla_t * const P, rkchn_t * const C)
 {
   C->curPer = C->ptaStp
     ? do_portamento(C)
-    : do_arpeggio(C)
+    : do_arpeggio(P, C)
     ;
-  return C->curPer + do_vibrato(C);
+  return C->curPer + do_vibrato(P, C);
 }
 
 static i16_t
-do_envelop(rkchn_t * const C)
+do_envelop(const rkpla_t * const P, rkchn_t * const C)
 {
   if ( --C->envW8t < 0 ) {
+    const rkins_t * const I = &P->mod->ins[C->curIns];
     int vol = C->curVol;
     int idx = C->envIdx;
-    const int aim = C->curIns->adsr[idx].vol;
-    const int inc = C->curIns->adsr[idx].inc;
+    const int aim = I->adsr[idx].vol;
+    const int inc = I->adsr[idx].inc;
 
     assert( idx >= 0 && idx < 4 );
     assert( vol >= 0 && vol < 0x40 );
@@ -481,10 +747,155 @@ rk_play_chan(rkpla_t * const P, rkchn_t * const C)
     C->endVol = C->curVol;
   }
   else {
-    do_asid(C);
-    C->endPer = do_period(C);
-    C->endVol = do_envelop(C);
+    do_asid(P, C);
+    C->endPer = do_period(P, C);
+    C->endVol = do_envelop(P, C);
+  }
+}
+
+/* ----------------------------------------------------------------------
+ *  Loop detection
+ * ---------------------------------------------------------------------- */
+
+static uint64_t
+fnv(uint64_t h, const void * dat, unsigned len)
+{
+  const uint8_t * b = dat;
+  while (len--)
+    h = (h ^ *b++) * 0x100000001B3ull;
+  return h;
+}
+
+/* Append LEN bytes of DAT to the key at KEY (0 once it is full), END
+ * being the end of the key buffer.
+ */
+static uint8_t *
+key_put(uint8_t * key, const uint8_t * end, const void * dat, unsigned len)
+{
+  if (!key || len > (unsigned) (end - key))
+    return 0;
+  memcpy(key, dat, len);
+  return key + len;
+}
+
+/* Serialize everything that drives the future output: the channels,
+ * the voices and the SID state (including the altered sample bytes).
+ * Returns the key length or -1 if it exceeds MAX bytes.
+ */
+static int
+state_key(const rkpla_t * P, uint8_t * key, int max)
+{
+  const uint8_t * const beg = key, * const end = key + max;
+  int k;
+
+  for (k=0; k<4; ++k) {
+    const rkchn_t * const C = &P->chn[k];
+    const rkvoc_t * const V = &P->mix.voc;
+    const int32_t per[] = {
+      C->endPer, C->oldPer, C->curPer, C->ptaPer,
+      C->endVol, C->oldVol, C->curVol,
+      C->seqW8t, C->arpIdx, C->envW8t, C->sidW8t, C->vibIdx, C->vibW8t
+    };
+    const uint8_t byt[] = {
+      C->trg, C->seqNot, C->ptaNot, C->ptaStp, C->seqRep, C->seqTra,
+      C->fx84_1, C->envIdx, C->envSpd,
+      C->curIns, C->oldIns
+    };
+    const uint32_t adr[] = { C->sngPtr, C->seqPtr, C->arpAdr };
+    key = key_put(key, end, per, sizeof(per));
+    key = key_put(key, end, byt, sizeof(byt));
+    key = key_put(key, end, adr, sizeof(adr));
+    if (!C->trg) {
+      /* A triggered voice restarts anyway */
+      const int on = V->on & (1<<k);
+      const uint32_t voc[] = {
+	on ? V->pcm[k] + 1 : 0, V->sb & (1<<k),
+	on ? V->end[k] + 1 : 0, V->acu[k]
+      };
+      key = key_put(key, end, voc, sizeof(voc));
+    }
+  }
+
+  key = key_put(key, end, P->sid, P->mod->nbi * sizeof(*P->sid));
+  key = key_put(key, end, P->sbk, P->mod->sbkLen * sizeof(*P->sbk));
+  return key ? key - beg : -1;
+}
+
+/* At each song-list wrap point the player state is compared to the
+ * state saved at previous wrap points. A match means the song is
+ * exactly periodic from then on. Like Brent's cycle detection the
+ * states are saved at power of two wrap counts so that long periods
+ * are found with a fixed amount of memory. The hashes only select the
+ * candidates, the saved states are compared in full.
+ *
+ * GB: SID alters sample bytes on its own cycle. Songs using it are
+ *     rarely periodic after a single loop.
+ */
+static void
+loop_check(rkpla_t * const P)
+{
+  rkwrap_t * const W = P->wrp;
+  uint8_t key[RKKEYLEN];
+  const int len = state_key(P, key, sizeof(key));
+  const u32_t n = ++P->nwrap;
+  uint64_t h;
+  int i;
+
+  if (len < 0) {
+    /* Too much state to be saved: no detection */
+    P->wrp = 0;
+    return;
   }
+  h = fnv(0xCBF29CE484222325ull, key, len);
+  for (i=0; i<RKMAXWRAP && W[i].tic; ++i)
+    if (W[i].hash == h && W[i].len == (u32_t) len &&
+	!memcmp(W[i].key, key, len)) {
+      P->lpTic = W[i].tic;
+      P->lpLen = P->tic - P->lpTic;
+      return;
+    }
+
+  if ( ! (n & (n-1)) && i < RKMAXWRAP ) {
+    W[i].tic  = P->tic;
+    W[i].len  = len;
+    W[i].hash = h;
+    memcpy(W[i].key, key, len);
+  }
+}
+
+int rk_loop_sizeof(void)
+{
+  return RKMAXWRAP * sizeof(rkwrap_t);
+}
+
+/* Detect the song loop using BUF (rk_loop_sizeof() bytes), 0 to
+ * stop. The detection restarts.
+ */
+int rk_loop_detect(rkpla_t * const P, void * buf)
+{
+  P->wrp = buf;
+  P->nwrap = P->lpTic = P->lpLen = 0;
+  if (buf)
+    memset(buf, 0, rk_loop_sizeof());
+  return 0;
+}
+
+int rk_loop(const rkpla_t * const P, unsigned * ptic)
+{
+  if (ptic)
+    *ptic = P->lpTic;
+  return P->lpLen;
+}
+
+/* Ignored channels are not sequenced at all. They count as ended so
+ * that the song still ends.
+ */
+int rk_ignore(rkpla_t * const P, int ign)
+{
+  const int old = P->ign;
+  if (ign >= 0 && ign <= 15)
+    P->ign = ign;
+  return old;
 }
 
 int rk_play(rkpla_t * const P)
@@ -492,11 +903,108 @@ int rk_play(rkpla_t * const P)
   u8_t k;
   ++ P->tic;
   P->evt &= 0x0F;
+  P->evt |= P->ign;
   for (k=0; k<4 && !P->err; ++k)
-    rk_play_chan(P,&P->chn[k]);
+    if ( ! (P->ign & (1<<k)) )
+      rk_play_chan(P,&P->chn[k]);
+  if ( (P->evt & 0x0F0) && P->wrp && !P->lpLen && !P->err )
+    loop_check(P);
   return P->err ? -P->err : P->evt;
 }
 
+/* ----------------------------------------------------------------------
+ *  Held ticks
+ * ---------------------------------------------------------------------- */
+
+#define RKMAXHOLD 0x7FFF
+
+/* Ticks following the current one during which the channel keeps its
+ * period and volume and reports no event. The volume of a muted
+ * channel (MIX=0) is not considered: its voice only advances, but at
+ * the step of its period and from its last trigger.
+ */
+static int
+chan_hold(const rkpla_t * const P, const rkchn_t * const C, int mix)
+{
+  const rkins_t * const I = &P->mod->ins[C->curIns];
+  const uint8_t * const arp = P->raw + C->arpAdr;
+  int n = C->seqW8t - 1;		/* up to the next sequence read */
+
+  if (n <= 0)
+    return n;
+
+  if ( C->trg || (mix && C->oldVol != C->endVol) )
+    return 0;
+
+  /* Period */
+  if (I->vibSpd) {
+    if (C->vibW8t <= 0)
+      return 0;
+    if (C->vibW8t < n)
+      n = C->vibW8t;
+  }
+  if (C->ptaStp) {
+    if (C->curPer != C->ptaPer || C->endPer != C->curPer)
+      return 0;
+  } else {
+    const i16_t per = period(C->seqNot, C->seqTra, arp[0]);
+    int k;
+    if (per != C->endPer)
+      return 0;
+    for (k=1; k<12; ++k)
+      if (period(C->seqNot, C->seqTra, arp[k]) != per)
+	return 0;
+  }
+
+  /* Volume (the last envelope stage once reached does not change) */
+  if ( mix && ! ( C->envIdx == 3 && C->curVol == I->adsr[3].vol ) &&
+       C->envW8t < n )
+    n = C->envW8t < 0 ? 0 : C->envW8t;
+
+  return n;
+}
+
+/* Number of ticks following the current one that can be mixed with
+ * it in a single span: rk_play() will change neither the periods nor
+ * the volumes of the channels not in MUTE nor the samples, and will
+ * report no new event.
+ */
+int rk_hold(const rkpla_t * const P, int mute)
+{
+  int j, k, n = RKMAXHOLD;
+
+  if (P->err)
+    return 0;
+  mute |= P->ign;
+  for (k=0; k<4; ++k)
+    if ( ! (P->ign & (1<<k)) ) {
+      const int h = chan_hold(P, &P->chn[k], !(mute & (1<<k)));
+      if (h < n)
+	n = h;
+    }
+
+  /* Up to the next SID write altering a sample being mixed */
+  for (j=0; j<4 && n > 0; ++j) {
+    const rkchn_t * const C = &P->chn[j];
+    const rkins_t * const I = &P->mod->ins[C->curIns];
+    int lo, hi;
+
+    if ( (P->ign & (1<<j)) || !I->sidSpd || C->sidW8t >= n )
+      continue;
+    lo = (int) I->pcm + I->sidBas - I->sidLen;
+    hi = lo + I->sidLen*2;
+    for (k=0; k<4; ++k) {
+      const rkins_t * const J = &P->mod->ins[P->chn[k].curIns];
+      if ( ! (mute & (1<<k)) && J->pcm &&
+	   lo < (int) (J->pcm + J->len) && hi >= (int) J->pcm ) {
+	n = C->sidW8t;
+	break;
+      }
+    }
+  }
+  return n < 0 ? 0 : n;
+}
+
 static inline int16_t lagrange(i32_t p1, i32_t p2, i32_t p3, u32_t idx)
 {
   const i32_t j = (idx >> 9) & 0x7F; /* the mid point is f(.5) */
@@ -520,32 +1028,114 @@ static inline int16_t lagrange(i32_t p1, i32_t p2, i32_t p3, u32_t idx)
   return r;
 }
 
+/* Sample fetchers. The result is a fixed point 8 sample. The samples
+ * after P are read from the bank guard at the end of the sample.
+ */
+#define FETCH_NONE(P,A) ( (P)[0] << 8 )
+#define FETCH_LINEAR(P,A)						\
+  ( ( (P)[0] << 8 ) + ( (P)[1] - (P)[0] ) * (i32_t)( (A) >> 8 ) )
+#define FETCH_QUADRATIC(P,A)						\
+  lagrange( (P)[0], (P)[1], (P)[2], A )
+
+/* Mix kernels are specialized on the sample fetcher, the volume ramp
+ * and the sample loop so that the most common case (constant volume
+ * and looped sample) runs the leanest loop.
+ */
+#define MIX_KERNEL(NAME, FETCH, RAMP, LOOP)				\
+  static void								\
+  NAME(int32_t * mix, int n, rkvoc_t * const V,			\
+       const int16_t * const bnk, const int k)				\
+  {									\
+    const int16_t * pcm = bnk + V->pcm[k], * end = bnk + V->end[k];	\
+    const int16_t * const lpadr = bnk + V->lpadr[k];			\
+    const u32_t stp = V->stp[k];					\
+    const i32_t vtp = V->vtp[k];					\
+    i32_t vol = V->vol[k];						\
+    u32_t acu = V->acu[k];						\
+									\
+    while (--n >= 0) {							\
+      *mix += ( FETCH(pcm,acu) * vol ) >> 15;				\
+      mix += 2;								\
+      if (RAMP)								\
+	vol += vtp;							\
+      acu += stp;							\
+      pcm += acu >> 16;							\
+      acu &= 0xFFFF;							\
+      if ( pcm >= end ) {						\
+	if (!LOOP) {							\
+	  V->on &= ~(1<<k);						\
+	  pcm = bnk;							\
+	  acu = 0;							\
+	  break;							\
+	}								\
+	pcm = lpadr + ( pcm - end ) % (u32_t)(V->lpend[k] - V->lpadr[k]); \
+	end = bnk + V->lpend[k];					\
+      }									\
+    }									\
+    V->pcm[k] = pcm - bnk;						\
+    V->end[k] = end - bnk;						\
+    V->acu[k] = acu;							\
+    V->vol[k] = vol;							\
+  }
+
+#define MIX_KERNELS(NAME, FETCH)					\
+  MIX_KERNEL(NAME##_cst_one, FETCH, 0, 0)				\
+  MIX_KERNEL(NAME##_cst_lpd, FETCH, 0, 1)				\
+  MIX_KERNEL(NAME##_rmp_one, FETCH, 1, 0)				\
+  MIX_KERNEL(NAME##_rmp_lpd, FETCH, 1, 1)
+
+MIX_KERNELS(mix_none, FETCH_NONE)
+MIX_KERNELS(mix_line, FETCH_LINEAR)
+MIX_KERNELS(mix_quad, FETCH_QUADRATIC)
+
+typedef void (*mix_f)(int32_t *, int, rkvoc_t * const,
+		      const int16_t * const, const int);
+
+/* [interpolation][ramp][loop] */
+static const mix_f mixers[3][2][2] = {
+  { { mix_none_cst_one, mix_none_cst_lpd },
+    { mix_none_rmp_one, mix_none_rmp_lpd } },
+  { { mix_line_cst_one, mix_line_cst_lpd },
+    { mix_line_rmp_one, mix_line_rmp_lpd } },
+  { { mix_quad_cst_one, mix_quad_cst_lpd },
+    { mix_quad_rmp_one, mix_quad_rmp_lpd } },
+};
+
+static void
+mix_voice(int32_t * mix, int n, rkvoc_t * V, const int16_t * bnk,
+	  int k, u8_t itp)
+{
+  assert( itp < 3 );
+  if (V->on & (1<<k))
+    mixers[itp][!!V->vtp[k]][!!(V->lp & (1<<k))](mix, n, V, bnk, k);
+}
 
+/* Advance a voice by N frames without mixing it. The position after N
+ * steps is computed at once, wrapped into the loop or stopping the
+ * voice past its end, as the mixers would leave it.
+ */
 static void
-mix_voice(int16_t * mix, int n, voice_t * V)
-{
-  const u32_t lplen = V->lpend - V->lpadr;
-
-  if (V->pcm) {
-    while (--n >= 0) {
-      *(mix) += (*V->pcm * V->vol) >> 7;
-      mix += 2;
-      V->vol += V->vtp;
-      V->acu += V->stp;
-      V->pcm += V->acu >> 16;
-      V->acu &= 0xFFFF;
-      if ( V->pcm >= V->end ) {
-	if (!V->lpadr) {
-	  V->pcm = 0;
-	  V->acu = 0;
-	  break;
-	} else {
-	  V->pcm = V->lpadr + ( V->pcm - V->end ) % lplen;
-	  V->end = V->lpend;
-	}
-      }
+skip_voice(int n, rkvoc_t * V, int k)
+{
+  uint64_t adv;
+
+  if ( ! (V->on & (1<<k)) )
+    return;
+  V->vol[k] += V->vtp[k] * n;
+  adv = V->acu[k] + (uint64_t) V->stp[k] * n;
+  V->acu[k] = adv & 0xFFFF;
+  adv = V->pcm[k] + ( adv >> 16 );
+  if ( adv >= V->end[k] ) {
+    if ( ! (V->lp & (1<<k)) ) {
+      V->on &= ~(1<<k);
+      V->pcm[k] = 0;
+      V->acu[k] = 0;
+      return;
     }
+    adv = V->lpadr[k] + ( adv - V->end[k] ) % (V->lpend[k] - V->lpadr[k]);
+    V->end[k] = V->lpend[k];
   }
+  V->pcm[k] = adv;
 }
 
 static inline u32_t
@@ -557,19 +1147,47 @@ calc_step(u32_t per, u32_t spr)
 }
 
 static void
-rk_mix_chan(rkchn_t * const C, int16_t * mix, u16_t ppt, u32_t spr)
+trigr_voice(rkvoc_t * const V, int k, const rkins_t * const I)
+{
+  const u32_t bnk = I->sb ? I->sbk : I->bnk;
+
+  V->pcm[k]   = bnk;
+  V->end[k]   = bnk + I->len;
+  V->lpadr[k] = I->loop ? bnk : 0;
+  V->lpend[k] = I->loop ? bnk + I->len : 0;
+  V->acu[k]   = 0;
+  V->on = I->pcm ? V->on | (1<<k) : V->on & ~(1<<k);
+  V->lp = I->loop ? V->lp | (1<<k) : V->lp & ~(1<<k);
+  V->sb = I->sb ? V->sb | (1<<k) : V->sb & ~(1<<k);
+}
+
+/* Bank voice K of V reads from. */
+static inline const int16_t *
+voice_bank(const rkpla_t * const P, const rkvoc_t * const V, int k)
+{
+  return V->sb & (1<<k) ? P->sbk : P->mod->bnk;
+}
+
+/* Setup the voice for this tick. Returns non zero if the channel is
+ * audible during this tick. A muted voice only advances.
+ */
+static int
+rk_mix_chan(rkchn_t * const C, rkstat_t * const st, rkvoc_t * const V,
+	    int k, u16_t ppt, u32_t spr, u16_t gain, int mute)
 {
 #if 1
-  C->voice.vol = C->oldVol << 8;
-  C->voice.vtp = ( (C->endVol-C->oldVol) << 8 ) / (int)ppt;
+  V->vol[k] = C->oldVol << 8;
+  V->vtp[k] = ( (C->endVol-C->oldVol) << 8 ) / (int)ppt;
 #else
-  C->voice.vol = C->endVol << 8;
-  C->voice.vtp = 0;
+  V->vol[k] = C->endVol << 8;
+  V->vtp[k] = 0;
 #endif
+  if (gain != 0x100) {
+    V->vol[k] = V->vol[k] * gain >> 8;
+    V->vtp[k] = V->vtp[k] * gain >> 8;
+  }
 
-  if (C->voice.pcm) {
-    struct stat * st = & C->curIns->stats[C->num];
-
+  if ( (V->on & (1<<k)) && st && !mute ) {
     if (!st->count++) {
       st->perMin = st->perMax = C->endPer;
       st->volMin = st->volMax = C->endVol;
@@ -586,20 +1204,951 @@ rk_mix_chan(rkchn_t * const C, int16_t * mix, u16_t ppt, u32_t spr)
     }
   }
 
-  C->voice.stp = calc_step(C->endPer, spr);
-  mix_voice(mix, ppt, &C->voice);
+  if ( ! (V->on & (1<<k)) )
+    return 0;
+
+  V->stp[k] = calc_step(C->endPer, spr);
+  if ( mute || ! (C->oldVol | C->endVol) ) {
+    /* Silent: only the sample position has to progress */
+    skip_voice(ppt, V, k);
+    return 0;
+  }
+  return 1;
 }
 
-void rk_mix(rkpla_t * const P, void * mix, int ppt, int spr, int mute)
+int rk_interp(rkpla_t * const P, int itp)
+{
+  const int old = P->mix.itp;
+  if (itp >= RK_INTERP_NONE && itp <= RK_INTERP_QUADRATIC)
+    P->mix.itp = itp;
+  return old;
+}
+
+/* ----------------------------------------------------------------------
+ *  Output stage
+ * ---------------------------------------------------------------------- */
+
+/* Bilinear transform of a 1-pole RC filter. */
+static void
+biq_rc(rkbiq_t * B, double fc, double spr, int hp)
+{
+  const double k = tan(M_PI * fc / spr);
+  const double n = 1.0 / (1.0 + k);
+
+  B->b0 = hp ? n : k*n;
+  B->b1 = hp ? -n : k*n;
+  B->b2 = 0;
+  B->a1 = (k-1.0) * n;
+  B->a2 = 0;
+}
+
+/* 2-pole low-pass (RBJ cookbook). */
+static void
+biq_lp2(rkbiq_t * B, double fc, double q, double spr)
+{
+  const double w = 2.0 * M_PI * fc / spr;
+  const double a = sin(w) / (2.0*q);
+  const double c = cos(w);
+  const double n = 1.0 / (1.0 + a);
+
+  B->b0 = (1.0-c) * 0.5 * n;
+  B->b1 = (1.0-c) * n;
+  B->b2 = B->b0;
+  B->a1 = -2.0 * c * n;
+  B->a2 = (1.0-a) * n;
+}
+
+/* Component values are the ones of the A500 (rev 6A) and A1200
+ * schematics:
+ *
+ * - A500  RC low-pass  360R/0.1uF    ~4421Hz
+ * - A1200 RC low-pass  680R/6.8nF   ~34419Hz
+ * - RC high-pass (both) 1390R/22uF     ~5.2Hz
+ * - "LED" Sallen-Key low-pass 10K/10K/6800pF/3900pF ~3091Hz Q=0.660
+ */
+static void
+flt_setup(rkout_t * const P, u32_t spr)
+{
+  const double r1 = 10e3, r2 = 10e3, c1 = 6800e-12, c2 = 3900e-12;
+  const double rc = sqrt(r1*r2*c1*c2);
+  const int mdl = P->flt & 3;
+  int k = 0;
+
+  memset(P->biq, 0, sizeof(P->biq));
+  if (mdl == RK_FILTER_A500)
+    biq_rc(P->biq+k++, 1.0/(2.0*M_PI*360.0*0.1e-6), spr, 0);
+  else if (mdl == RK_FILTER_A1200 && spr > 2*34419)
+    biq_rc(P->biq+k++, 1.0/(2.0*M_PI*680.0*6.8e-9), spr, 0);
+  if (P->flt & RK_FILTER_LED)
+    biq_lp2(P->biq+k++, 1.0/(2.0*M_PI*rc), rc/(c2*(r1+r2)), spr);
+  if (mdl)
+    biq_rc(P->biq+k++, 1.0/(2.0*M_PI*1390.0*22e-6), spr, 1);
+  P->nbq = k;
+  P->fspr = spr;
+}
+
+static int
+out_filter(rkout_t * const O, int flt)
+{
+  const int old = O->flt;
+  if ( (flt & 3) <= RK_FILTER_A1200 && !(flt & ~(3|RK_FILTER_LED)) ) {
+    O->flt = flt;
+    O->fspr = 0;
+  }
+  return old;
+}
+
+int rk_filter(rkpla_t * const P, int flt)
+{
+  return out_filter(&P->mix.out, flt);
+}
+
+static inline int16_t
+clip(i32_t v)
+{
+  return v < -0x8000 ? -0x8000 : v > 0x7FFF ? 0x7FFF : v;
+}
+
+/* Round to nearest (even) and clip, like clip(lrintf(X)) in the
+ * default rounding mode but without the library call.
+ */
+static inline int16_t
+clip_float(float x)
+{
+#if FLT_EVAL_METHOD == 0
+  x = x < -32768.f ? -32768.f : x > 32767.f ? 32767.f : x;
+  return (x + 12582912.f) - 12582912.f;	/* 1.5 * 2^23 */
+#else
+  return clip( lrintf(x) );
+#endif
+}
+
+/* Convert the mix bus to 16-bit. The filters run as a cascade of
+ * biquads (transposed direct form II) with both stereo sides
+ * processed together.
+ */
+static void
+bus_output(rkout_t * const P, int16_t * out, const int32_t * bus, int n)
+{
+  if (!P->nbq) {
+    for (n *= 2; n > 0; --n)
+      *out++ = clip(*bus++);
+  } else {
+    rkbiq_t * const end = P->biq + P->nbq;
+    int i;
+
+    for ( ; n > 0; --n, bus += 2, out += 2) {
+      rkbiq_t * B;
+      float x[2];
+
+      for (i=0; i<2; ++i)
+	x[i] = bus[i] + 1e-18f;		/* avoid denormals */
+      for (B = P->biq; B < end; ++B)
+	for (i=0; i<2; ++i) {
+	  const float y = B->b0 * x[i] + B->z1[i];
+	  B->z1[i] = B->b1 * x[i] - B->a1 * y + B->z2[i];
+	  B->z2[i] = B->b2 * x[i] - B->a2 * y;
+	  x[i] = y;
+	}
+      for (i=0; i<2; ++i)
+	out[i] = clip_float(x[i]);
+    }
+  }
+}
+
+/* Prepare the voices for the next PPT frames. Returns the audible
+ * channels.
+ */
+static u8_t
+mix_setup(rkpla_t * const P, rkmix_t * const X, int ppt, int spr, int mute)
+{
+  const int own = X == &P->mix;
+  int k;
+  u8_t act = 0;
+
+  if (own)
+    P->frm += ppt;
+  if (P->err)
+    return 0;
+  X->spr = spr;
+  for (k=0; k<4; ++k) {
+    rkchn_t * const C = &P->chn[k];
+    rkstat_t * const st = own && P->sts ? P->sts + C->curIns*4 + k : 0;
+    if (P->ign & (1<<k))
+      continue;
+    if (C->trg)
+      trigr_voice(&X->voc, k, &P->mod->ins[C->curIns]);
+    if ( rk_mix_chan(C, st, &X->voc, k, ppt, spr, X->gain,
+		     mute & (1<<k)) )
+      act |= 1 << k;
+  }
+  return X->act = act;
+}
+
+/* Mix the audible voices into the bus. */
+static void
+mix_run(const rkpla_t * const P, rkmix_t * const X, int32_t * bus, int n,
+	u8_t act)
+{
+  static const u8_t side[4] = { 0, 1, 1, 0 };
+  int k;
+
+  for (k=0; k<4; ++k)
+    if (act & (1<<k))
+      mix_voice(bus+side[k], n, &X->voc, voice_bank(P, &X->voc, k), k,
+		X->itp);
+}
+
+int rk_gain(rkpla_t * const P, int gain)
+{
+  const int old = P->mix.gain;
+  if (gain >= 0 && gain <= 0x200)
+    P->mix.gain = gain;
+  return old;
+}
+
+int rk_mixer_sizeof(void)
+{
+  return sizeof(rkmix_t);
+}
+
+void rk_mixer_init(rkmix_t * const X, const rkpla_t * const P)
+{
+  *X = P->mix;
+  X->out.fspr = 0;
+}
+
+void rk_mix_to(rkpla_t * const P, rkmix_t * const X,
+	       void * mix, int ppt, int spr, int mute)
 {
   int16_t * const m16 = mix;
+  int32_t bus[RKBUSLEN*2];
+  const u8_t act = mix_setup(P, X, ppt, spr, mute);
+  int i, n;
+
+  if (P->err) {
+    memset(mix, 0, ppt*4);
+    return;
+  }
+  if (X->out.fspr != (u32_t) spr)
+    flt_setup(&X->out, spr);
+
+  for (i=0; i<ppt; i+=n) {
+    n = ppt-i < RKBUSLEN ? ppt-i : RKBUSLEN;
+    if (!act && !X->out.nbq) {
+      /* Silent tick */
+      memset(m16+2*i, 0, n*4);
+      continue;
+    }
+    memset(bus, 0, n*8);
+    mix_run(P, X, bus, n, act);
+    bus_output(&X->out, m16+2*i, bus, n);
+  }
+}
+
+void rk_mix(rkpla_t * const P, void * mix, int ppt, int spr, int mute)
+{
+  rk_mix_to(P, &P->mix, mix, ppt, spr, mute);
+}
+
+/* Advance the own mixer like rk_mix() without producing output. The
+ * voices end up where rk_mix() would leave them; the output filter
+ * state is not updated.
+ */
+void rk_skip(rkpla_t * const P, int ppt, int spr, int mute)
+{
+  const u8_t act = mix_setup(P, &P->mix, ppt, spr, mute);
+  int k;
+
+  for (k=0; k<4; ++k)
+    if (act & (1<<k))
+      skip_voice(ppt, &P->mix.voc, k);
+}
+
+/* Advance the own mixer like rk_skip() and estimate the output levels
+ * of the tick from the voice volumes and the sample levels. The
+ * extremes are those of the voices summed, the mean square assumes
+ * uncorrelated voices. Returns the audible channels.
+ */
+int rk_level(rkpla_t * const P, rklvl_t * L, int ppt, int spr, int mute)
+{
+  static const u8_t side[4] = { 0, 1, 1, 0 };
+  rkvoc_t * const V = &P->mix.voc;
+  const u8_t act = mix_setup(P, &P->mix, ppt, spr, mute);
+  double lo[2] = { 0, 0 }, hi[2] = { 0, 0 };
+  int k;
+
+  memset(L, 0, sizeof(*L));
+  for (k=0; k<4; ++k) {
+    const rkins_t * const I = &P->mod->ins[P->chn[k].curIns];
+    const double v0 = V->vol[k], v1 = V->vol[k] + V->vtp[k] * ppt;
+    const double vol = ( v0 > v1 ? v0 : v1 ) / 128.0;
+    const int s = side[k];
+
+    int min = I->lvMin, max = I->lvMax;
+    double sqr = I->lvSqr;
+
+    if ( ! (act & (1<<k)) )
+      continue;
+    if (I->sb) {
+      /* Altered by the SID: levels of the player copy */
+      const int16_t * const pcm = P->sbk + I->sbk;
+      u32_t i;
+      min = max = 0;
+      sqr = 0;
+      for (i=0; i<I->len; ++i) {
+	if (pcm[i] < min)
+	  min = pcm[i];
+	else if (pcm[i] > max)
+	  max = pcm[i];
+	sqr += pcm[i] * pcm[i];
+      }
+    }
+    if (I->len) {
+      lo[s] += min * vol;
+      hi[s] += max * vol;
+      L->ms[s] += sqr / I->len *
+	(v0*v0 + v0*v1 + v1*v1) / ( 3.0 * 128.0 * 128.0 );
+    }
+    skip_voice(ppt, V, k);
+  }
+  for (k=0; k<2; ++k) {
+    L->min[k] = clip(lrint(lo[k]));
+    L->max[k] = clip(lrint(hi[k]));
+  }
+  return act;
+}
+
+/* ----------------------------------------------------------------------
+ *  Mixer bus
+ * ---------------------------------------------------------------------- */
+
+int rk_bus_sizeof(int nbs)
+{
+  return nbs < 1 ? -1 :
+    (int) sizeof(rkbus_t) + (nbs-1) * (int) sizeof(rkslot_t);
+}
+
+int rk_bus_init(rkbus_t * const B, int nbs, int spr)
+{
+  int i;
+
+  if (!B || nbs < 1 || spr < 1)
+    return -1;
+  memset(B, 0, rk_bus_sizeof(nbs));
+  B->nbs = nbs;
+  B->spr = spr;
+  for (i=0; i<RKCMDLEN; ++i)
+    B->cmd[i].seq = i;
+  return 0;
+}
+
+int rk_bus_filter(rkbus_t * const B, int flt)
+{
+  return out_filter(&B->out, flt);
+}
+
+/* Attach an initialized player to a slot (0 to detach). The slot is
+ * stopped.
+ */
+int rk_bus_attach(rkbus_t * const B, int slot, rkpla_t * const P)
+{
+  rkslot_t * S;
+
+  if (slot < 0 || slot >= B->nbs)
+    return -1;
+  S = B->slot + slot;
+  memset(S, 0, sizeof(*S));
+  if (P) {
+    S->pla = P;
+    S->ppt = (B->spr + (P->frq>>1)) / P->frq;
+  }
+  return 0;
+}
+
+int rk_bus_start(rkbus_t * const B, int slot, int loop)
+{
+  if (slot < 0 || slot >= B->nbs || !B->slot[slot].pla)
+    return -1;
+  B->slot[slot].on = 1;
+  B->slot[slot].loop = !!loop;
+  return 0;
+}
+
+int rk_bus_stop(rkbus_t * const B, int slot)
+{
+  if (slot < 0 || slot >= B->nbs)
+    return -1;
+  B->slot[slot].on = 0;
+  return 0;
+}
+
+int rk_bus_gain(rkbus_t * const B, int slot, int gain)
+{
+  if (slot < 0 || slot >= B->nbs || !B->slot[slot].pla)
+    return -1;
+  return rk_gain(B->slot[slot].pla, gain);
+}
+
+int rk_bus_mute(rkbus_t * const B, int slot, int mute)
+{
+  int old;
+  if (slot < 0 || slot >= B->nbs)
+    return -1;
+  old = B->slot[slot].mute;
+  B->slot[slot].mute = mute & 15;
+  return old;
+}
+
+/* Run a slot for N frames. The player is ticked as needed. */
+static void
+slot_run(rkslot_t * const S, int32_t * bus, int n, u32_t spr)
+{
+  rkpla_t * const P = S->pla;
+
+  while (n > 0) {
+    int k;
+
+    if (!S->left) {
+      const int evt = rk_play(P);
+      if ( evt < 0 || (!S->loop && (evt & 15) == 15) ) {
+	S->on = 0;
+	return;
+      }
+      S->act  = mix_setup(P, &P->mix, S->ppt, spr, S->mute);
+      S->left = S->ppt;
+    }
+    k = (u32_t) n < S->left ? n : (int) S->left;
+    if (S->act)
+      mix_run(P, &P->mix, bus, k, S->act);
+    S->left -= k;
+    bus += 2*k;
+    n -= k;
+  }
+}
+
+/* Publish the position of the slot for rk_bus_pos(). */
+static void
+slot_pos(rkslot_t * const S)
+{
+  if (S->pla)
+    __atomic_store_n(&S->pos, (uint64_t) S->pla->tic << 32 |
+		     (uint64_t) S->on << 31 |
+		     (S->left ? S->ppt - S->left : 0), __ATOMIC_RELEASE);
+}
+
+/* Queue a command for the slot from any thread. It is run by the next
+ * rk_bus_mix(). Lock-free; returns -1 if the queue is full or the
+ * command is invalid. Song numbers are checked here so that the mixer
+ * only restarts the slot's own player.
+ */
+int rk_bus_post(rkbus_t * const B, int slot, int cmd, int arg)
+{
+  u32_t pos = __atomic_load_n(&B->cmdWr, __ATOMIC_RELAXED);
+  const rkpla_t * P;
+  rkcmd_t * C;
+
+  if (slot < 0 || slot >= B->nbs || cmd < RK_CMD_PLAY || cmd > RK_CMD_GAIN)
+    return -1;
+  P = B->slot[slot].pla;
+  if (cmd == RK_CMD_SONG && (!P || arg < 1 || arg > P->mod->nbs))
+    return -1;
+  for (;;) {
+    int32_t dif;
+    C = B->cmd + (pos & (RKCMDLEN-1));
+    dif = (int32_t) (__atomic_load_n(&C->seq, __ATOMIC_ACQUIRE) - pos);
+    if (dif < 0)
+      return -1;
+    if (!dif && __atomic_compare_exchange_n(&B->cmdWr, &pos, pos+1, 1,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+      break;
+    if (dif)
+      pos = __atomic_load_n(&B->cmdWr, __ATOMIC_RELAXED);
+  }
+  C->cmd  = cmd;
+  C->slot = slot;
+  C->arg  = arg;
+  __atomic_store_n(&C->seq, pos+1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Run the queued commands. It stops at a command still being written
+ * so that the mixer never waits. The position of the slot is
+ * published after each command.
+ */
+static void
+bus_commands(rkbus_t * const B)
+{
+  int n;
+
+  for (n=0; n<RKCMDLEN; ++n) {
+    rkcmd_t * const C = B->cmd + (B->cmdRd & (RKCMDLEN-1));
+    rkslot_t * S;
+
+    if (__atomic_load_n(&C->seq, __ATOMIC_ACQUIRE) != B->cmdRd+1)
+      break;
+    S = B->slot + C->slot;
+    switch (C->cmd) {
+    case RK_CMD_PLAY: rk_bus_start(B, C->slot, C->arg); break;
+    case RK_CMD_STOP: rk_bus_stop(B, C->slot); break;
+    case RK_CMD_MUTE: rk_bus_mute(B, C->slot, C->arg); break;
+    case RK_CMD_GAIN: rk_bus_gain(B, C->slot, C->arg); break;
+    case RK_CMD_SONG:
+      if (S->pla && rk_select_song(S->pla, C->arg) > 0)
+	S->left = 0;
+      break;
+    }
+    slot_pos(S);
+    __atomic_store_n(&C->seq, B->cmdRd + RKCMDLEN, __ATOMIC_RELEASE);
+    ++B->cmdRd;
+  }
+}
+
+/* Song position of a slot from any thread. Returns 1 if the slot is
+ * playing, 0 if not and -1 on error.
+ */
+int rk_bus_pos(const rkbus_t * const B, int slot, unsigned * tic,
+	       unsigned * frm)
+{
+  uint64_t pos;
+
+  if (slot < 0 || slot >= B->nbs)
+    return -1;
+  pos = __atomic_load_n(&B->slot[slot].pos, __ATOMIC_ACQUIRE);
+  if (tic)
+    *tic = pos >> 32;
+  if (frm)
+    *frm = pos & 0x7FFFFFFF;
+  return (pos >> 31) & 1;
+}
+
+/* Render N frames of all playing slots. Returns the mask of slots
+ * still playing. It is wait-free and does not allocate so that it can
+ * run in an audio callback; other threads control it with
+ * rk_bus_post().
+ */
+int rk_bus_mix(rkbus_t * const B, void * mix, int n)
+{
+  int16_t * m16 = mix;
+  int32_t bus[RKBUSLEN*2];
+  int i, on = 0;
+
+  bus_commands(B);
+  if (B->out.fspr != B->spr)
+    flt_setup(&B->out, B->spr);
+
+  while (n > 0) {
+    const int m = n < RKBUSLEN ? n : RKBUSLEN;
+    memset(bus, 0, m*8);
+    for (i=0; i<B->nbs; ++i)
+      if (B->slot[i].on)
+	slot_run(B->slot+i, bus, m, B->spr);
+    bus_output(&B->out, m16, bus, m);
+    m16 += 2*m;
+    n -= m;
+  }
+
+  for (i=0; i<B->nbs; ++i) {
+    slot_pos(B->slot+i);
+    if (B->slot[i].on && i < 32)
+      on |= 1 << i;
+  }
+  return on;
+}
+
+/* ----------------------------------------------------------------------
+ *  Batch
+ * ---------------------------------------------------------------------- */
+
+/* Run a tick of the N players P. Their events are stored in EVT.
+ * Returns the number of players that ended or failed.
+ */
+int rk_batch_play(rkpla_t * const * P, int n, int * evt)
+{
+  int i, end = 0;
+
+  for (i=0; i<n; ++i) {
+#ifdef __GNUC__
+    if (i+1 < n)
+      __builtin_prefetch(P[i+1]->chn, 1);
+#endif
+    evt[i] = rk_play(P[i]);
+    end += evt[i] < 0 || (evt[i] & 15) == 15;
+  }
+  return end;
+}
+
+/* Sample fetchers for the voices mixed along with others. They run
+ * the voice like the mix kernels and store the fetched samples in
+ * OUT. Returns the number of samples (less than N if the sample
+ * ended).
+ */
+#define FETCH_KERNEL(NAME, FETCH, LOOP)					\
+  static int								\
+  NAME(int32_t * out, int n, rkvoc_t * const V,				\
+       const int16_t * const bnk, const int k)				\
+  {									\
+    const int16_t * pcm = bnk + V->pcm[k], * end = bnk + V->end[k];	\
+    const int16_t * const lpadr = bnk + V->lpadr[k];			\
+    const u32_t stp = V->stp[k];					\
+    u32_t acu = V->acu[k];						\
+    int i = 0;								\
+									\
+    while (i < n) {							\
+      out[i++] = FETCH(pcm,acu);					\
+      acu += stp;							\
+      pcm += acu >> 16;							\
+      acu &= 0xFFFF;							\
+      if ( pcm >= end ) {						\
+	if (!LOOP) {							\
+	  V->on &= ~(1<<k);						\
+	  pcm = bnk;							\
+	  acu = 0;							\
+	  break;							\
+	}								\
+	pcm = lpadr + ( pcm - end ) % (u32_t)(V->lpend[k] - V->lpadr[k]); \
+	end = bnk + V->lpend[k];					\
+      }									\
+    }									\
+    V->pcm[k] = pcm - bnk;						\
+    V->end[k] = end - bnk;						\
+    V->acu[k] = acu;							\
+    return i;								\
+  }
+
+FETCH_KERNEL(fetch_none_one, FETCH_NONE, 0)
+FETCH_KERNEL(fetch_none_lpd, FETCH_NONE, 1)
+FETCH_KERNEL(fetch_line_one, FETCH_LINEAR, 0)
+FETCH_KERNEL(fetch_line_lpd, FETCH_LINEAR, 1)
+FETCH_KERNEL(fetch_quad_one, FETCH_QUADRATIC, 0)
+FETCH_KERNEL(fetch_quad_lpd, FETCH_QUADRATIC, 1)
+
+typedef int (*fetch_f)(int32_t *, int, rkvoc_t * const,
+		       const int16_t * const, const int);
+
+/* [interpolation][loop] */
+static const fetch_f fetchers[3][2] = {
+  { fetch_none_one, fetch_none_lpd },
+  { fetch_line_one, fetch_line_lpd },
+  { fetch_quad_one, fetch_quad_lpd },
+};
+
+/* Scale N fetched samples by the volume VOL ramped by VTP. Returns
+ * the volume at the end.
+ */
+static i32_t
+batch_scale(int32_t * out, const int32_t * smp, int n, i32_t vol, i32_t vtp)
+{
+  int i;
+
+  if (!vtp)
+    for (i=0; i<n; ++i)
+      out[i] = ( smp[i] * vol ) >> 15;
+  else
+    for (i=0; i<n; ++i) {
+      out[i] = ( smp[i] * vol ) >> 15;
+      vol += vtp;
+    }
+  return vol;
+}
+
+/* Voices playing the same sample at the same position, phase and
+ * step (most often the same song started at the same time) read the
+ * same samples. They are mixed in groups: the samples are fetched
+ * once and added at the volume of each voice.
+ */
+typedef struct rkgrp rkgrp_t;
+struct rkgrp {
+  const int16_t * bnk;			/* bank of the voices */
+  uint8_t itp;
+  uint8_t nmb;				/* number of voices */
+  uint16_t mbr;				/* first voice in the member list */
+  uint16_t nxt;				/* next group in the hash chain */
+};
 
-  memset(mix, 0, ppt*4);
-  if (P->err) return;
-  P->spr = spr;
+static uint32_t
+voice_key(const rkvoc_t * V, int k, const int16_t * bnk, int itp)
+{
+  uint64_t h = (uintptr_t) (bnk + V->pcm[k]);
+  h = h * 0x9E3779B97F4A7C15ull ^ V->acu[k];
+  h = h * 0x9E3779B97F4A7C15ull ^ V->stp[k];
+  h = h * 0x9E3779B97F4A7C15ull ^ (V->end[k] + itp);
+  return h >> 40;
+}
+
+static int
+voice_same(const rkvoc_t * A, int a, const int16_t * abnk, int aitp,
+	   const rkvoc_t * B, int b, const int16_t * bbnk, int bitp)
+{
+  return abnk + A->pcm[a] == bbnk + B->pcm[b] &&
+    abnk + A->end[a] == bbnk + B->end[b] &&
+    A->acu[a] == B->acu[b] && A->stp[a] == B->stp[b] &&
+    !(A->lp & (1<<a)) == !(B->lp & (1<<b)) &&
+    abnk + A->lpadr[a] == bbnk + B->lpadr[b] &&
+    abnk + A->lpend[a] == bbnk + B->lpend[b] &&
+    aitp == bitp;
+}
+
+#define RKBATCH	  32			/* players grouped together */
+#define RKBATLEN  128			/* frames per pass */
+#define RKGRPHASH 256			/* group hash table size */
+#define RKNOGRP	  0xFFFF
+#define RKLANES	  16			/* filter lanes (2 per player) */
+
+/* Output stage of N players whose filters have the same coefficients.
+ * It runs like bus_output() but with the filter state laid out across
+ * the players, one lane per side, so that the lanes run side by side
+ * instead of each player waiting on its own recurrence.
+ */
+static void
+batch_output(rkout_t * const * O, int n, int32_t * const * bus,
+	     int16_t * const * out, int m)
+{
+  const rkbiq_t * const C = O[0]->biq;
+  const int nbq = O[0]->nbq;
+  float z1[RKLANES], z2[RKLANES], x[RKBATLEN][RKLANES];
+  int i, l, p, q;
+
+  assert( n > 1 && n <= RKLANES/2 && m <= RKBATLEN );
+  if (n < RKLANES/2)
+    memset(x, 0, sizeof(x));
+  for (p=0; p<n; ++p)
+    for (i=0; i<m; ++i) {
+      x[i][2*p]   = bus[p][2*i]   + 1e-18f;	/* avoid denormals */
+      x[i][2*p+1] = bus[p][2*i+1] + 1e-18f;
+    }
+
+  for (q=0; q<nbq; ++q) {
+    const float b0 = C[q].b0, b1 = C[q].b1, b2 = C[q].b2;
+    const float a1 = C[q].a1, a2 = C[q].a2;
+
+    memset(z1, 0, sizeof(z1));
+    memset(z2, 0, sizeof(z2));
+    for (p=0; p<n; ++p) {
+      z1[2*p] = O[p]->biq[q].z1[0]; z1[2*p+1] = O[p]->biq[q].z1[1];
+      z2[2*p] = O[p]->biq[q].z2[0]; z2[2*p+1] = O[p]->biq[q].z2[1];
+    }
+    for (i=0; i<m; ++i)
+      for (l=0; l<RKLANES; ++l) {
+	const float y = b0 * x[i][l] + z1[l];
+	z1[l] = b1 * x[i][l] - a1 * y + z2[l];
+	z2[l] = b2 * x[i][l] - a2 * y;
+	x[i][l] = y;
+      }
+    for (p=0; p<n; ++p) {
+      O[p]->biq[q].z1[0] = z1[2*p]; O[p]->biq[q].z1[1] = z1[2*p+1];
+      O[p]->biq[q].z2[0] = z2[2*p]; O[p]->biq[q].z2[1] = z2[2*p+1];
+    }
+  }
+
+  for (p=0; p<n; ++p)
+    for (i=0; i<m; ++i) {
+      out[p][2*i]   = clip_float(x[i][2*p]);
+      out[p][2*i+1] = clip_float(x[i][2*p+1]);
+    }
+}
+
+/* Filters with the same coefficients. */
+static int
+out_same(const rkout_t * A, const rkout_t * B)
+{
+  int q;
+
+  if (A->nbq != B->nbq)
+    return 0;
+  for (q=0; q<A->nbq; ++q)
+    if (A->biq[q].b0 != B->biq[q].b0 || A->biq[q].b1 != B->biq[q].b1 ||
+	A->biq[q].b2 != B->biq[q].b2 || A->biq[q].a1 != B->biq[q].a1 ||
+	A->biq[q].a2 != B->biq[q].a2)
+      return 0;
+  return 1;
+}
+
+/* Players whose voices are in the same groups at the same volumes and
+ * whose output filters are in the same state produce the same output.
+ */
+static int
+batch_same(const rkpla_t * A, const uint16_t * agid,
+	   const rkpla_t * B, const uint16_t * bgid)
+{
+  const rkvoc_t * const V = &A->mix.voc, * const W = &B->mix.voc;
+  const rkout_t * const O = &A->mix.out, * const Q = &B->mix.out;
+  int k;
+
+  for (k=0; k<4; ++k)
+    if (agid[k] != bgid[k] || (agid[k] != RKNOGRP &&
+			       (V->vol[k] != W->vol[k] ||
+				V->vtp[k] != W->vtp[k])))
+      return 0;
+  return O->nbq == Q->nbq &&
+    !memcmp(O->biq, Q->biq, O->nbq * sizeof(*O->biq));
+}
+
+/* Mix a tick of up to RKBATCH players. */
+static void
+batch_block(rkpla_t * const * P, int n, void * const * mix,
+	    int ppt, int spr, int mute)
+{
+  static const u8_t side[4] = { 0, 1, 1, 0 };
+  int32_t bus[RKBATCH][RKBATLEN*2], smp[RKBATLEN], sc[RKBATLEN];
+  rkgrp_t grp[RKBATCH*4];
+  uint16_t hash[RKGRPHASH];
+  struct { uint8_t pla, k; } mbr[RKBATCH*4];
+  uint16_t nxt[RKBATCH*4];		/* next voice of the group */
+  uint16_t gid[RKBATCH*4];		/* group of the voice */
+  uint8_t cpy[RKBATCH];			/* player whose output is copied */
+  uint8_t done[RKBATCH];		/* output stage done */
+  rkout_t * out[RKLANES/2];		/* players filtered together */
+  int32_t * obus[RKLANES/2];
+  int16_t * omix[RKLANES/2];
+  int i, j, l, m, g, nout, ngrp = 0;
+
+  /* Setup the voices and group the audible ones */
+  memset(hash, 0xFF, sizeof(hash));
+  for (i=0; i<n; ++i) {
+    rkmix_t * const X = &P[i]->mix;
+    const u8_t act = mix_setup(P[i], X, ppt, spr, mute);
+    int k;
+
+    if (!P[i]->err && X->out.fspr != (u32_t) spr)
+      flt_setup(&X->out, spr);
+    for (k=0; k<4; ++k) {
+      const int16_t * const bnk = voice_bank(P[i], &X->voc, k);
+      const uint32_t h = voice_key(&X->voc, k, bnk, X->itp) % RKGRPHASH;
+      const int v = i*4+k;
+      rkgrp_t * G = 0;
+
+      gid[v] = RKNOGRP;
+      if ( ! (act & X->voc.on & (1<<k)) )
+	continue;
+      for (g = hash[h]; g != RKNOGRP; g = grp[g].nxt) {
+	const int l = grp[g].mbr;
+	const rkpla_t * const L = P[mbr[l].pla];
+	if (voice_same(&L->mix.voc, mbr[l].k, grp[g].bnk, L->mix.itp,
+		       &X->voc, k, bnk, X->itp)) {
+	  G = grp+g;
+	  break;
+	}
+      }
+      mbr[v].pla = i;
+      mbr[v].k   = k;
+      nxt[v] = RKNOGRP;
+      if (!G) {
+	G = grp + ngrp;
+	G->bnk = bnk;
+	G->itp = X->itp;
+	G->nmb = 0;
+	G->mbr = v;
+	G->nxt = hash[h];
+	hash[h] = ngrp++;
+      } else {
+	/* Append to keep the member order */
+	int l = G->mbr;
+	while (nxt[l] != RKNOGRP)
+	  l = nxt[l];
+	nxt[l] = v;
+      }
+      ++G->nmb;
+      gid[v] = G - grp;
+    }
+
+    /* Look for an earlier player with the same output */
+    cpy[i] = i;
+    for (j=0; j<i && !P[i]->err; ++j)
+      if (cpy[j] == j && !P[j]->err &&
+	  batch_same(P[j], gid+j*4, P[i], gid+i*4)) {
+	cpy[i] = j;
+	break;
+      }
+  }
+
+  for (j=0; j<ppt; j+=m) {
+    m = ppt-j < RKBATLEN ? ppt-j : RKBATLEN;
+    for (i=0; i<n; ++i)
+      if (cpy[i] == i)
+	memset(bus[i], 0, m*8);
+
+    for (g=0; g<ngrp; ++g) {
+      const rkgrp_t * const G = grp+g;
+      const int l = G->mbr;
+      rkvoc_t * const V = &P[mbr[l].pla]->mix.voc;
+      const int k = mbr[l].k;
+      i32_t vol = 0, vtp = 0, end = 0;
+      int v, cnt;
+
+      if ( ! (V->on & (1<<k)) )
+	continue;
+      if (G->nmb == 1) {
+	mixers[G->itp][!!V->vtp[k]][!!(V->lp & (1<<k))]
+	  (bus[mbr[l].pla]+side[k], m, V, G->bnk, k);
+	continue;
+      }
+      cnt = fetchers[G->itp][!!(V->lp & (1<<k))](smp, m, V, G->bnk, k);
+      for (v = l; v != RKNOGRP; v = nxt[v]) {
+	const int p = mbr[v].pla, w = mbr[v].k;
+	rkvoc_t * const W = &P[p]->mix.voc;
+
+	/* Members at the same volume share the scaled samples */
+	if (v == l || W->vol[w] != vol || W->vtp[w] != vtp) {
+	  vol = W->vol[w];
+	  vtp = W->vtp[w];
+	  end = batch_scale(sc, smp, cnt, vol, vtp);
+	}
+	if (cpy[p] == p) {
+	  int32_t * const out = bus[p] + side[w];
+	  for (i=0; i<cnt; ++i)
+	    out[2*i] += sc[i];
+	}
+	W->vol[w] = end;
+	if (W != V || w != k) {
+	  W->pcm[w] = V->pcm[k];
+	  W->end[w] = V->end[k];
+	  W->acu[w] = V->acu[k];
+	  W->on = (W->on & ~(1<<w)) | (V->on & (1<<k) ? 1<<w : 0);
+	}
+      }
+    }
+
+    /* Output stage, the players sharing filter coefficients together */
+    for (i=0; i<n; ++i)
+      done[i] = cpy[i] != i || P[i]->err;
+    for (i=0; i<n; ++i) {
+      if (done[i])
+	continue;
+      for (l=i, nout=0; l<n && nout<RKLANES/2; ++l)
+	if (!done[l] && out_same(&P[i]->mix.out, &P[l]->mix.out)) {
+	  done[l] = 1;
+	  out[nout]  = &P[l]->mix.out;
+	  obus[nout] = bus[l];
+	  omix[nout++] = (int16_t *) mix[l] + 2*j;
+	}
+      if (nout > 1 && out[0]->nbq)
+	batch_output(out, nout, obus, omix, m);
+      else
+	for (l=0; l<nout; ++l)
+	  bus_output(out[l], omix[l], obus[l], m);
+    }
+  }
+
+  for (i=0; i<n; ++i)
+    if (P[i]->err)
+      memset(mix[i], 0, ppt*4);
+    else if (cpy[i] != i) {
+      rkout_t * const O = &P[i]->mix.out;
+      memcpy(mix[i], mix[cpy[i]], ppt*4);
+      memcpy(O->biq, P[cpy[i]]->mix.out.biq, O->nbq * sizeof(*O->biq));
+    }
+}
+
+/* Mix a tick of PPT frames of the N players P like rk_mix() does for
+ * each of them. Players are mixed RKBATCH at a time.
+ */
+void rk_batch_mix(rkpla_t * const * P, int n, void * const * mix,
+		  int ppt, int spr, int mute)
+{
+  int i;
 
-  if ( ! (mute & 1) ) rk_mix_chan(&P->chn[0], m16+0, ppt, spr);
-  if ( ! (mute & 2) ) rk_mix_chan(&P->chn[1], m16+1, ppt, spr);
-  if ( ! (mute & 4) ) rk_mix_chan(&P->chn[2], m16+1, ppt, spr);
-  if ( ! (mute & 8) ) rk_mix_chan(&P->chn[3], m16+0, ppt, spr);
+  for (i=0; i<n; i+=RKBATCH)
+    batch_block(P+i, n-i < RKBATCH ? n-i : RKBATCH, mix+i, ppt, spr, mute);
 }
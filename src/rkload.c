@@ -37,6 +37,8 @@
 #include <string.h>
 #include <stdlib.h>
 
+void rk_decode_inst(rkmod_t * M); /* rklib.c */
+
 int rk_decode_header(rkmod_t * mod)
 {
   const rkf_hd_t * const hd = (const rkf_hd_t *)mod->raw;
@@ -60,14 +62,36 @@ int rk_decode_header(rkmod_t * mod)
     );
 }
 
+/* Samples needed by the bank of the instruments of MOD. */
+static u32_t bank_len(const rkmod_t * mod)
+{
+  const rkf_ins_t * idef = (const rkf_ins_t *) mod->_ins;
+  u32_t len = 0;
+  int k;
+
+  for (k=0; k<mod->nbi; ++k, ++idef) {
+    const rkf_spl_t * def = self(idef->tospl);
+    if (def)
+      len += RKBNKSEG(U16(def->len) << 1);
+  }
+  return len;
+}
+
+/* Offset of the (aligned) sample bank in a module of SIZ bytes. */
+static intptr_t bank_off(u16_t siz)
+{
+  return ( (intptr_t)(((rkmod_t*)0)->raw) + siz + 15 ) & ~15;
+}
+
 rkmod_t * rk_load(const char * path, int * perr)
 {
   int err;
   FILE * f;
 
-  rkmod_t * mod = 0;
+  rkmod_t * mod = 0, * tmp;
   rkf_hd_t hd;
   unsigned int sz;
+  u32_t len;
 
   assert( sizeof(hd) == 16 );
 
@@ -92,6 +116,7 @@ rkmod_t * rk_load(const char * path, int * perr)
   if (!mod)
     goto error_exit;
   memcpy(mod->raw,&hd,sizeof(hd));
+  mod->bnk = 0;
 
   err = 3;
   if (rk_decode_header(mod))
@@ -102,6 +127,20 @@ rkmod_t * rk_load(const char * path, int * perr)
   if (fread(mod->raw+sizeof(hd),1,sz,f) != sz)
     goto error_exit;
 
+  /* Make room for the sample bank */
+  err = 4;
+  len = bank_len(mod);
+  tmp = realloc(mod, bank_off(mod->siz) + len*2);
+  if (!tmp)
+    goto error_exit;
+  mod = tmp;
+  rk_decode_header(mod);
+  mod->bnk = (int16_t *) ( (uint8_t *) mod + bank_off(mod->siz) );
+  mod->bnkLen = len;
+
+  /* Decode the instruments and fill the sample bank */
+  rk_decode_inst(mod);
+
   err = 0;
 error_exit:
   if (f) fclose(f);
@@ -111,11 +150,34 @@ error_exit:
   return mod;
 }
 
+/* Copy a module loaded by rk_load(), decoded instruments and sample
+ * bank included. Players do not alter their module; they can share
+ * it.
+ */
+rkmod_t * rk_mod_dup(const rkmod_t * src)
+{
+  const int off = (intptr_t)(((rkmod_t*)0)->raw);
+  const int siz = src->bnk
+    ? (int) ( (const uint8_t *) (src->bnk + src->bnkLen) - src->raw )
+    : (int) src->siz;
+  rkmod_t * mod = malloc(off+siz);
+
+  if (mod) {
+    memcpy(mod, src, off+siz);
+    if (src->bnk)
+      mod->bnk = (int16_t *) ( mod->raw + ((const uint8_t *) src->bnk -
+					    src->raw) );
+    mod->_sng = mod->raw + (src->_sng - src->raw);
+    mod->_arp = mod->raw + (src->_arp - src->raw);
+    mod->_ins = mod->raw + (src->_ins - src->raw);
+  }
+  return mod;
+}
+
 void rklog(const char * fmt, ...);
 
-static void print_stat(rkins_t *I)
+static void print_stat(const rkins_t *I, const rkstat_t * st)
 {
-  struct stat * st = I->stats;
   int k;
 
   rklog("\n"
@@ -124,8 +186,8 @@ static void print_stat(rkins_t *I)
 	".B"[!!st[1].count],
 	".C"[!!st[2].count],
 	".D"[!!st[3].count],
-	I->pcmEnd - I->pcmAdr,
-	!I->lpAdr ? " (1-shot)":"");
+	(unsigned) I->len,
+	!I->loop ? " (1-shot)":"");
 
   for (k=0; k < 4; ++k, ++st) {
     if (!st->count) continue;
@@ -139,7 +201,8 @@ static void print_stat(rkins_t *I)
 void rk_print_stats(rkpla_t * const P)
 {
   int i;
-  for (i=0; i<P->mod->nbi; ++i)
-    if (P->ins[i].pcmAdr)
-      print_stat(P->ins+i);
+  if (P->sts)
+    for (i=0; i<P->mod->nbi; ++i)
+      if (P->mod->ins[i].pcm)
+	print_stat(P->mod->ins+i, P->sts+i*4);
 }
@@ -42,17 +42,22 @@ static const char bugreport[] = \
 #define _GNU_SOURCE			/* for GNU basename() */
 
 enum {
-  SPR_DEF = 48000
+  SPR_DEF = 48000,
+  SPR_MIN = 6000,
+  SPR_MAX = 96000,			/* mixer */
+  SPR_RSP = 384000			/* resampler (-M) */
 };
 
 enum {
-  OUT_IS_LIVE, OUT_IS_WAVE, OUT_IS_NULL, OUT_IS_FILE
+  OUT_IS_LIVE, OUT_IS_WAVE, OUT_IS_NULL, OUT_IS_FILE, OUT_IS_SHM
 };
 
 static const char typename[][5] = {
-  "live","wave","null","file"
+  "live","wave","null","file","shm"
 };
 
+static const char shmname[] = "/rkplay";	/* default -S object */
+
 enum {
   RK_OK, RK_ERR, RK_ARG, RK_INP, RK_OUT
 };
@@ -62,10 +67,12 @@ enum {
  * ---------------------------------------------------------------------- */
 
 #include "rkplay.h"
+#include "rkshm.h"
 
 /* stdc */
 #include <assert.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -73,6 +80,8 @@ enum {
 #include <errno.h>
 #include <limits.h>
 #include <getopt.h>
+#include <signal.h>
+#include <math.h>
 
 #ifdef WIN32
 #ifdef __MINGW32__
@@ -80,6 +89,19 @@ enum {
 #endif
 #include <io.h>
 #include <fcntl.h>
+#else
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #endif
 
 #include "ao/ao.h"
@@ -91,11 +113,17 @@ void rk_print_stats(rkpla_t * const P); /* rkload.c */
  * ---------------------------------------------------------------------- */
 
 static long mystrtoul(char **s, const int base);
+static long str_rate(char **s);
 static int uint_mute(char * arg, char * name);
+static int str_filter(char * arg);
+static void cache_write(const void * blk, int bytes);
 
 static int opt_mute, opt_ignore, opt_outtype = OUT_IS_LIVE, opt_stats;
-static long opt_spr = SPR_DEF;
-static char * opt_output, * opt_input;
+static int opt_realtime, opt_loops = 1, opt_interp = RK_INTERP_NONE;
+static int opt_filter = RK_FILTER_NONE, opt_trace, opt_jobs = 1;
+static int opt_analyze, opt_mixrate, opt_xfade, opt_overview;
+static long opt_cachemax = 1024;
+static char * opt_output, * opt_input, * opt_cache;
 static char * prgname;
 
 /* ----------------------------------------------------------------------
@@ -112,7 +140,7 @@ static void print_usage(void)
   const char * name="?", * desc;
 
   puts (
-    "Usage: rkplay [OPTIONS] <song.rk>" "\n"
+    "Usage: rkplay [OPTIONS] <song.rk[#N]>..." "\n"
     "\n"
     "  Ron Klaren's BattleSquadron music player\n"
     "\n"
@@ -124,18 +152,33 @@ static void print_usage(void)
     "OPTIONS:\n"
     " -h --help --usage  Print this message and exit.\n"
     " -V --version       Print version and copyright and exit.\n"
-    " -r --rate=         Set sampling rate (support `k' suffix).\n"
+    " -r --rate=Hz[,Hz]  Set sampling rate(s) (support `k' suffix).\n"
     " -m --mute=CHANS    Mute selected channels (bit-field or string).\n"
-    " -o --output=URI    Set output file name (-w or -c).\n"
+    " -i --ignore=CHANS  Do not play selected channels at all.\n"
+    " -o --output=URI    Set output file name (-w, -c or -S).\n"
     " -c --stdout        Output raw PCM to stdout or file (native 16-bit).\n"
     " -n --null          Output to the void.\n"
+    " -S --shm           Output to a shared memory ring (default /rkplay).\n"
     " -w --wav           Generated a .wav file.\n"
     " -s --stats         Print various statistics on exit.\n"
+    " -R --realtime      Live output with SCHED_FIFO and locked memory.\n"
+    " -l --loops=N       Play the song N times (default 1).\n"
+    " -I --interp=MODE   Sample interpolation (none,linear,quadratic).\n"
+    " -F --filter=MODEL  Amiga output filter (none,a500,a1200[,led]).\n"
+    " -T --trace         Print the player events.\n"
+    " -j --jobs=N        Render to file with N threads (default 1).\n"
+    " -t --tee=TYPE[:URI] Also send the output to another sink.\n"
+    " -a --analyze       Print peak, loudness and hash of the output.\n"
+    " -M --mixrate=Hz    Mix at this rate and convert to the output rate(s).\n"
+    " -X --xfade=MS      Crossfade the playlist entries (default 0).\n"
+    " -W --overview=N    Write an N points waveform overview instead.\n"
+    " -C --cache=DIR     Serve renders from and keep them in DIR.\n"
+    " -K --cache-size=MB Cache size limit (default 1024).\n"
     );
 
   puts(
     "OUTPUT:\n"
-    " Options `-n/--null',`-c/--stdout' and `-w/--wav' are used to set the\n"
+    " Options `-n/--null',`-c/--stdout',`-w/--wav' and `-S/--shm' set the\n"
     " output type. The last one is used. Without it the default output type\n"
     " is used which should be playing sound via the default or configured\n"
     " libao driver.\n"
@@ -146,11 +189,67 @@ static void print_usage(void)
     " `-n/--null'    output is ignored\n"
     " `-c/--stdout'  output to the specified file instead of `stdout'.\n"
     " `-w/--wav'     unless set output is a file based on song filename.\n"
+    " `-S/--shm'     output is the name of the POSIX shared memory ring.\n"
+    "\n"
+    " With `-t/--tee' the output is also sent to other sinks. TYPE is one\n"
+    " of `live', `wave', `file', `shm' or `null' (e.g. `--tee=wave:song.wav'\n"
+    " or `--tee=file:-' for stdout). Extra sinks are written by their own\n"
+    " thread so that a slow one does not stall the render.\n"
+    "\n"
+    " With `-S/--shm' the frames are written to a POSIX shared memory ring\n"
+    " (see rkshm.h) created or attached to. The consumer paces the render.\n"
+    "\n"
+    " With `-a/--analyze' the output is measured (sample and true peak,\n"
+    " RMS, EBU R128 loudness, ReplayGain, clips and a 64-bit hash). A JSON\n"
+    " line per rate is printed on stdout. Output defaults to `-n/--null'.\n"
+    "\n"
+    " Several sampling rates can be rendered in a single pass to file or\n"
+    " wav outputs. Each output name gets the rate appended (e.g.\n"
+    " `song-44100.wav').\n"
+    "\n"
+    " With `-M/--mixrate' the song is mixed once at a fixed rate and\n"
+    " converted to each output rate by a polyphase resampler. Output\n"
+    " rates up to 384kHz are then possible.\n"
+    "\n"
+    " With `-l/--loops', once the song is detected to be exactly periodic\n"
+    " the loop is not rendered again but repeated from memory.\n"
+    "\n"
+    " With `-j/--jobs', the song is first run without mixing to take\n"
+    " snapshots of the player. Segments between snapshots are then mixed\n"
+    " concurrently. The output is identical to a single thread render.\n"
+    "\n"
+    " With `-W/--overview' the song is not rendered. The sequencer runs\n"
+    " as usual but the levels are estimated per tick from the volumes and\n"
+    " the instrument samples. The peaks file (`-o' or stdout) has a 20\n"
+    " bytes header (\"RKPK\", version, channels, points, rate, frames) then\n"
+    " min, max and RMS of both channels per point (16-bit little-endian).\n"
+    "\n"
+    " With `-C/--cache', a single rate render to a file, wav, shm or null\n"
+    " output is kept in DIR, named after a hash of the module file and of\n"
+    " the options changing the output. The same render is then served from\n"
+    " the file. The least recently used renders are removed above the size\n"
+    " limit. It is not used with -s, -T, -W or a playlist.\n"
+    "\n"
+    " With live output, render time, jitter and underrun statistics are\n"
+    " printed on exit or when receiving SIGUSR1.\n"
+    "\n"
+    "PLAYLIST:\n"
+    " Songs are given as `FILE' or `FILE#N' for song N (default 1). With\n"
+    " several songs, they are played back to back to the same output. The\n"
+    " next one is loaded and its start rendered by a thread while the\n"
+    " current one plays. A single rate without -j, -M, -s or -T is required.\n"
+    "\n"
+    "MODEL:\n"
+    " Emulate the output stage of an A500 (RC low-pass at 4.4kHz) or an\n"
+    " A1200 (RC low-pass at 34kHz). Both include the 5Hz high-pass. Add\n"
+    " `led' (e.g. `a500,led') for the 3.1kHz 2-pole \"LED\" filter.\n"
     "\n"
     "CHANS:\n"
     " Select channels to be either muted or ignored. It can be either:\n"
     " . an integer representing a mask of selected channels (C-style prefix)\n"
     " . a string containing the letter A to D (case insensitive) in any order\n"
+    " Muted channels are still sequenced. Ignored channels are neither\n"
+    " sequenced nor mixed and the song ends with the remaining ones.\n"
     );
   puts(copyright);
   puts(license);
@@ -158,72 +257,1479 @@ static void print_usage(void)
 }
 
 /**
- * Print version and copyright message.
+ * Print version and copyright message.
+ */
+static void print_version(void)
+{
+  printf("%s"
+#ifndef NDEBUG
+	 " (DEBUG BUILD)"
+#endif
+	 "\n", rk_version());
+  puts(copyright);
+  puts(license);
+}
+
+/* ----------------------------------------------------------------------
+ * Writers
+ * ---------------------------------------------------------------------- */
+
+static FILE * infofile = 0;
+
+void rklog_va(const char * fmt, va_list list)
+{
+  assert(infofile);
+  if (infofile)
+    vfprintf(infofile,fmt,list);
+}
+
+void rklog(const char * fmt, ...)
+{
+  va_list list;
+  va_start(list,fmt);
+  rklog_va(fmt,list);
+  va_end(list);
+}
+
+static int emsg(const char * fmt, ...)
+{
+  va_list list;
+  va_start(list, fmt);
+  fprintf(stderr, "%s: ", prgname);
+  vfprintf(stderr, fmt, list);
+  va_end(list);
+  fflush(stderr);
+  return RK_ERR;
+}
+
+/* ----------------------------------------------------------------------
+ * Live telemetry
+ * ---------------------------------------------------------------------- */
+
+enum {
+  LAT_BINS = 10
+};
+
+/* Histogram bins of the render time as a percentage of the tick
+ * deadline: [0-1[ [1-2[ [2-4[ ... [64-100[ [100-200[ [200-...[
+ */
+static const char latname[LAT_BINS][9] = {
+  "<1%", "<2%", "<4%", "<8%", "<16%", "<32%", "<64%", "<100%",
+  "<200%", ">=200%"
+};
+
+static struct {
+  int	   on;				/* telemetry enabled */
+  const void * dev;			/* timed device (main output) */
+  uint64_t spr;				/* device sampling rate */
+  uint64_t ddl;				/* tick deadline (ns) */
+  uint64_t t0;				/* audio clock origin (ns) */
+  uint64_t frm;				/* frames queued since t0 */
+  uint64_t beg;				/* render start of this block */
+  uint64_t end;				/* last render end */
+  unsigned long blk;			/* rendered blocks */
+  unsigned long ovr;			/* blocks over the deadline */
+  unsigned long xrun;			/* estimated underruns */
+  uint64_t sum, max;			/* render time (ns) */
+  uint64_t jit, jmax;			/* write interval jitter (ns) */
+  unsigned long hist[LAT_BINS];
+} lat;
+
+static volatile sig_atomic_t lat_signaled;
+
+#ifndef WIN32
+
+static uint64_t lat_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void lat_sighandler(int sig)
+{
+  (void) sig;
+  lat_signaled = 1;
+}
+
+#else
+
+static uint64_t lat_now(void) { return 0; }
+
+#endif
+
+static void lat_init(unsigned spr, unsigned ppt, const void * dev)
+{
+  memset(&lat, 0, sizeof(lat));
+  lat.on  = 1;
+  lat.dev = dev;
+  lat.spr = spr;
+  lat.ddl = 1000000000ull * ppt / spr;
+#ifdef SIGUSR1
+  signal(SIGUSR1, lat_sighandler);
+#endif
+}
+
+static inline void lat_begin(void)
+{
+  if (lat.on)
+    lat.beg = lat_now();
+}
+
+static void lat_done(void)
+{
+  uint64_t now, dt, pct;
+  int bin;
+
+  if (!lat.on)
+    return;
+
+  now = lat_now();
+  dt  = now - lat.beg;
+  pct = 100u * dt / lat.ddl;
+  for (bin = 0; bin < 7 && pct >= (1u << bin); ++bin)
+    ;
+  if (bin == 7 && pct >= 100)
+    bin = pct < 200 ? 8 : 9;
+
+  ++lat.hist[bin];
+  ++lat.blk;
+  lat.sum += dt;
+  if (dt > lat.max)
+    lat.max = dt;
+  if (dt > lat.ddl)
+    ++lat.ovr;
+
+  /* Jitter is the deviation of the block period from the deadline */
+  if (lat.end) {
+    const uint64_t per = now - lat.end;
+    const uint64_t dev = per > lat.ddl ? per - lat.ddl : lat.ddl - per;
+    lat.jit += dev;
+    if (dev > lat.jmax)
+      lat.jmax = dev;
+  }
+  lat.end = now;
+}
+
+/**
+ * Account for frames about to be queued to the device. The device
+ * has starved if the wall clock went past the end of the audio
+ * queued so far. In which case the audio clock is restarted.
+ */
+static void lat_write(unsigned frames)
+{
+  if (lat.on) {
+    const uint64_t now = lat_now();
+    if (!lat.t0)
+      lat.t0 = now;
+    else if (now > lat.t0 + lat.frm * 1000000000u / lat.spr) {
+      ++lat.xrun;
+      lat.t0  = now;
+      lat.frm = 0;
+    }
+    lat.frm += frames;
+  }
+}
+
+static void lat_report(FILE * out)
+{
+  int i;
+  const unsigned long blk = lat.blk ? lat.blk : 1;
+
+  if (!lat.on)
+    return;
+
+  fprintf(out,
+	  "live   : %lu blocks, deadline %lu us\n"
+	  "render : avg %lu us, max %lu us, %lu over deadline\n"
+	  "jitter : avg %lu us, max %lu us\n"
+	  "xrun   : %lu underrun(s) (estimated)\n",
+	  lat.blk, (unsigned long)(lat.ddl / 1000u),
+	  (unsigned long)(lat.sum / blk / 1000u),
+	  (unsigned long)(lat.max / 1000u), lat.ovr,
+	  (unsigned long)(lat.jit / blk / 1000u),
+	  (unsigned long)(lat.jmax / 1000u),
+	  lat.xrun);
+  for (i = 0; i < LAT_BINS; ++i)
+    if (lat.hist[i])
+      fprintf(out, "  %-6s %8lu (%3lu%%)\n",
+	      latname[i], lat.hist[i], 100u * lat.hist[i] / blk);
+  fflush(out);
+}
+
+/**
+ * Enter realtime mode: SCHED_FIFO scheduling and all memory (current
+ * and future) locked. The stack is prefaulted so that no page fault
+ * occurs once playback has started. Failures are not fatal.
+ */
+static void rt_enter(void * mix, int size)
+{
+#ifndef WIN32
+  struct sched_param sp;
+  volatile char stack[64<<10];
+  unsigned i;
+
+  memset(mix, 0, size);
+  for (i=0; i<sizeof(stack); ++i)
+    stack[i] = 0;
+  if (mlockall(MCL_CURRENT|MCL_FUTURE))
+    emsg("realtime: mlockall -- %s\n", strerror(errno));
+  memset(&sp, 0, sizeof(sp));
+  sp.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+  if (sched_setscheduler(0, SCHED_FIFO, &sp))
+    emsg("realtime: SCHED_FIFO -- %s\n", strerror(errno));
+#else
+  emsg("realtime: not supported on this platform\n");
+#endif
+}
+
+static int
+null_write(const void * data, void * cookie, int n)
+{
+  return n;
+}
+
+static int
+file_write(const void * data, void * cookie, int n)
+{
+  return fwrite(data,1,n,cookie);
+}
+
+static int
+live_write(const void * data, void * cookie, int n)
+{
+  /* Tees run in their own thread: only the main output is timed */
+  if (cookie == lat.dev)
+    lat_write(n >> 2);
+  return ao_play(cookie, (void*)data, n) == 0
+    ? 0 : n;
+}
+
+static int
+shm_write(const void * data, void * cookie, int n)
+{
+  return rk_shm_write(cookie, data, n);
+}
+
+static int
+wave_write(const void * data, void * cookie, int n)
+{
+  return ao_play(cookie, (void*)data, n) == 0
+    ? 0 : n;
+}
+
+/* ----------------------------------------------------------------------
+ * Targets
+ * ---------------------------------------------------------------------- */
+
+enum {
+  MAX_TARGETS = 8,
+  MAX_SINKS   = 4,
+  HOLD_MAX    = 64,			/* max ticks mixed at once */
+  FIFO_SIZE   = 4 << 20,			/* asynchronous sink buffer */
+  SHM_SIZE    = 1 << 20			/* shared memory ring */
+};
+
+/* A FIFO drained by a writer thread so that a slow sink does not stall
+ * the render nor the other sinks until it is full.
+ */
+typedef struct fifo fifo_t;
+struct fifo {
+  char	 * buf;
+  size_t   rd, wr;			/* read and write counters */
+  int	   done;			/* no more data */
+  int	   err;				/* write error */
+#ifndef WIN32
+  pthread_mutex_t mtx;
+  pthread_cond_t  cnd;
+  pthread_t	  tid;
+#endif
+};
+
+/* A sink is one output of a target. */
+typedef struct sink sink_t;
+struct sink {
+  int	      type;			/* OUT_IS_* */
+  char	    * output;			/* output name */
+  ao_device * aodev;
+  void	    * cookie;
+  int	   (* writer)(const void *, void *, int n);
+  fifo_t    * fifo;			/* 0: synchronous writes */
+};
+
+/* A target renders the song at one sampling rate. The player is run
+ * once per tick for all targets; each one has its own mixer and sends
+ * its blocks to all its sinks.
+ */
+typedef struct target target_t;
+struct target {
+  long	      spr;			/* sampling rate */
+  int	      ppt;			/* frames per tick */
+  rkmix_t   * mixer;			/* 0: player's own mixer */
+  void	    * mix;			/* mix buffer */
+  int	      nsink;
+  sink_t      sink[MAX_SINKS];
+  rkana_t   * ana;			/* output analysis */
+  rkrsp_t   * rsp;			/* from the mix rate (-M) */
+};
+
+static target_t targets[MAX_TARGETS];
+static int ntargets;
+
+/* Additional sinks (-t/--tee) */
+static struct tee {
+  int	 type;
+  char * uri;
+} tees[MAX_SINKS-1];
+static int ntees;
+
+/**
+ * Insert "-RATE" before the extension of a file name.
+ */
+static char * rate_name(const char * name, long spr)
+{
+  const char * b = strrchr(name,'/');
+  const char * e = strrchr(b ? b : name,'.');
+  const int len = e ? (int) (e - name) : (int) strlen(name);
+  char * out;
+
+  if (-1 == asprintf(&out, "%.*s-%ld%s", len, name, spr, e ? e : ""))
+    out = 0;
+  return out;
+}
+
+/* ----------------------------------------------------------------------
+ * Sinks
+ * ---------------------------------------------------------------------- */
+
+static void sink_error(const sink_t * S)
+{
+  if (!errno)
+    emsg("write error -- %s\n", S->output);
+  else
+    emsg("write error (%d) %s -- %s\n", errno, strerror(errno), S->output);
+}
+
+#ifndef WIN32
+
+static void * fifo_thread(void * arg)
+{
+  sink_t * const S = arg;
+  fifo_t * const F = S->fifo;
+
+  pthread_mutex_lock(&F->mtx);
+  for (;;) {
+    size_t n, pos;
+    while (F->rd == F->wr && !F->done)
+      pthread_cond_wait(&F->cnd, &F->mtx);
+    if (F->rd == F->wr)
+      break;
+    /* Write up to the end of the buffer */
+    pos = F->rd % FIFO_SIZE;
+    n = F->wr - F->rd;
+    if (n > FIFO_SIZE - pos)
+      n = FIFO_SIZE - pos;
+    pthread_mutex_unlock(&F->mtx);
+    errno = 0;
+    if (!F->err && S->writer(F->buf+pos, S->cookie, n) != (int) n) {
+      sink_error(S);
+      F->err = 1;
+    }
+    pthread_mutex_lock(&F->mtx);
+    F->rd += n;
+    pthread_cond_broadcast(&F->cnd);
+  }
+  pthread_mutex_unlock(&F->mtx);
+  return 0;
+}
+
+static void fifo_start(sink_t * S)
+{
+  fifo_t * const F = calloc(1, sizeof(*F));
+  if (!F || !(F->buf = malloc(FIFO_SIZE)))
+    abort();
+  pthread_mutex_init(&F->mtx, 0);
+  pthread_cond_init(&F->cnd, 0);
+  S->fifo = F;
+  if (pthread_create(&F->tid, 0, fifo_thread, S)) {
+    free(F->buf);
+    free(F);
+    S->fifo = 0;			/* fallback to synchronous */
+  }
+}
+
+static int fifo_push(fifo_t * F, const char * data, int n)
+{
+  pthread_mutex_lock(&F->mtx);
+  while (n > 0 && !F->err) {
+    size_t pos = F->wr % FIFO_SIZE, len = FIFO_SIZE - (F->wr - F->rd);
+    if (!len) {
+      pthread_cond_wait(&F->cnd, &F->mtx);
+      continue;
+    }
+    if (len > FIFO_SIZE - pos)
+      len = FIFO_SIZE - pos;
+    if (len > (size_t) n)
+      len = n;
+    memcpy(F->buf+pos, data, len);
+    F->wr += len;
+    data += len;
+    n -= len;
+    pthread_cond_broadcast(&F->cnd);
+  }
+  pthread_mutex_unlock(&F->mtx);
+  return F->err ? -1 : 0;
+}
+
+static void fifo_stop(fifo_t * F)
+{
+  pthread_mutex_lock(&F->mtx);
+  F->done = 1;
+  pthread_cond_broadcast(&F->cnd);
+  pthread_mutex_unlock(&F->mtx);
+  pthread_join(F->tid, 0);
+  pthread_mutex_destroy(&F->mtx);
+  pthread_cond_destroy(&F->cnd);
+  free(F->buf);
+  free(F);
+}
+
+#else
+
+/* Never used: -t is refused on this platform */
+static void fifo_start(sink_t * S) { }
+static int fifo_push(fifo_t * F, const char * data, int n) { return -1; }
+static void fifo_stop(fifo_t * F) { }
+
+#endif
+
+/**
+ * Open a sink of type TYPE at sampling rate SPR. NAME is the output
+ * name (0 for the default one of this type). Returns RK_OK or an
+ * error code.
+ */
+static int sink_open(sink_t * S, int type, const char * name, long * spr)
+{
+  ao_sample_format aofmt;
+  ao_info * aoinf;
+  int aoid;
+
+  S->type = type;
+  if (name) {
+    S->output = strdup(name);
+    if (!S->output) abort();
+  }
+
+  switch (type) {
+  case OUT_IS_NULL:
+    S->writer = null_write;
+    free(S->output);
+    S->output = strdup("");
+    break;
+  case OUT_IS_FILE:
+    S->writer = file_write;
+    if (S->output)
+      S->cookie = fopen(S->output,"wb");
+    else {
+#if (defined WIN32 || defined _WIN32) && defined _O_BINARY
+      int fd = fileno(stdout);
+      if (fd != -1)
+	_setmode(fd, _O_BINARY);
+#endif
+      S->output = strdup("<stdout>");
+      if (!S->output) abort();
+      infofile = stderr;
+      S->cookie = stdout;
+    }
+    if (!S->cookie) {
+      emsg("failed to open output -- %s\n", S->output);
+      return RK_OUT;
+    }
+    break;
+
+  case OUT_IS_SHM:
+    S->writer = shm_write;
+    if (!S->output)
+      S->output = strdup(shmname);
+    if (!S->output) abort();
+    S->cookie = rk_shm_open(S->output, SHM_SIZE, *spr);
+    if (!S->cookie) {
+      if (errno == EBUSY)
+	emsg("shared memory ring already has a writer -- %s\n",
+	     S->output);
+      else
+	emsg("failed to open shared memory -- %s\n", S->output);
+      return RK_OUT;
+    }
+    break;
+
+  case OUT_IS_LIVE: case OUT_IS_WAVE:
+    memset(&aofmt,0,sizeof(aofmt));
+    aofmt.bits	      = 16;
+    aofmt.rate	      = *spr;
+    aofmt.channels    = 2;
+    aofmt.byte_format = AO_FMT_NATIVE;
+
+    if (type == OUT_IS_WAVE) {
+      aoid  = ao_driver_id("wav");
+      S->aodev = ao_open_file(aoid, S->output, 1, &aofmt, 0);
+    } else {
+      aoid  = ao_default_driver_id();
+      S->aodev = ao_open_live(aoid, &aofmt, 0);
+    }
+    aoinf = ao_driver_info(aoid);
+    if (!S->aodev) {
+      emsg("failed to open audio device -- %s\n", aoinf->short_name);
+      return RK_OUT;
+    }
+    *spr = aofmt.rate;
+
+    if (aoinf->type == AO_TYPE_LIVE) {
+      free(S->output);
+      if (-1 == asprintf(&S->output, "%s@%luhz",aoinf->short_name,*spr))
+	S->output = 0;
+    }
+    if (!S->output) abort();
+
+    S->cookie = S->aodev;
+    S->writer = type == OUT_IS_LIVE ? live_write : wave_write;
+  }
+  assert(S->output);
+  return RK_OK;
+}
+
+static void sink_close(sink_t * S)
+{
+  if (S->fifo)
+    fifo_stop(S->fifo);
+  if (S->aodev)
+    ao_close(S->aodev);
+  else if (S->type == OUT_IS_SHM) {
+    if (S->cookie) {
+      rk_shm_eof(S->cookie);
+      rk_shm_close(S->cookie);
+    }
+  } else if (S->cookie && S->cookie != stdout)
+    fclose(S->cookie);
+  free(S->output);
+  memset(S, 0, sizeof(*S));
+}
+
+/**
+ * Send a block to all sinks of a target. Returns -1 on error.
+ */
+static int target_write(target_t * T, const void * blk, int bytes)
+{
+  int i;
+
+  if (T->ana)
+    rk_ana_run(T->ana, blk, bytes >> 2);
+  if (T == targets)
+    cache_write(blk, bytes);
+  for (i=0; i<T->nsink; ++i) {
+    sink_t * const S = T->sink+i;
+    if (S->fifo) {
+      if (fifo_push(S->fifo, blk, bytes))
+	return -1;
+      continue;
+    }
+    errno = 0;
+    if ( S->writer(blk, S->cookie, bytes) != bytes ) {
+      sink_error(S);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* ----------------------------------------------------------------------
+ * Analysis
+ * ---------------------------------------------------------------------- */
+
+static void print_level(FILE * out, const char * key, double v)
+{
+  if (isfinite(v))
+    fprintf(out, ",\"%s\":%.2f", key, v);
+  else
+    fprintf(out, ",\"%s\":null", key);
+}
+
+/**
+ * Print the analysis of a target as a JSON line.
+ */
+static void print_analysis(const target_t * T)
+{
+  FILE * out = stdout;
+  rkres_t R;
+  const char * s;
+  int i;
+
+  /* Unless stdout is an output */
+  for (i=0; i<T->nsink; ++i)
+    if (T->sink[i].cookie == stdout)
+      out = stderr;
+
+  rk_ana_result(T->ana, &R);
+  fputs("{\"input\":\"", out);
+  for (s = opt_input; *s; ++s)
+    if (*s == '"' || *s == '\\')
+      fprintf(out, "\\%c", *s);
+    else if ((unsigned char) *s < 32)
+      fprintf(out, "\\u%04x", *s);
+    else
+      fputc(*s, out);
+  fprintf(out, "\",\"rate\":%ld,\"frames\":%lu", T->spr, R.frames);
+  print_level(out, "peak", R.peak);
+  print_level(out, "truepeak", R.tpeak);
+  print_level(out, "rms", R.rms);
+  print_level(out, "loudness", R.lufs);
+  print_level(out, "replaygain", R.rgain);
+  fprintf(out, ",\"clips\":%lu,\"hash\":\"%016llx\"}\n",
+	  R.clips, R.hash);
+  fflush(out);
+}
+
+/* ----------------------------------------------------------------------
+ * Trace
+ * ---------------------------------------------------------------------- */
+
+static rkevt_t trcbuf[256];
+
+static void print_trace(rkpla_t * P)
+{
+  static const char names[][6] = {
+    "?", "note", "inst", "arpg", "porta", "seq", "wrap"
+  };
+  rkevt_t evt[32];
+  int i, n;
+
+  while (n = rk_trace_read(P, evt, 32), n > 0)
+    for (i=0; i<n; ++i) {
+      const rkevt_t * const E = evt+i;
+      rklog("%05u %9u %c %-5s %02X %02X\n",
+	    E->tic, E->frm, 'A'+E->chn,
+	    names[E->typ <= RK_EVT_SONGWRAP ? E->typ : 0],
+	    E->arg1, E->arg2);
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Loop buffer
+ * ---------------------------------------------------------------------- */
+
+enum {
+  LPB_MAX = 64 << 20			/* loop buffer memory limit */
+};
+
+static struct {
+  char * buf;
+  size_t len, max;
+} lpb;
+
+/**
+ * Keep a rendered block for later repeats. The buffer is dropped if
+ * it grows past LPB_MAX.
+ */
+static void lpb_push(const void * blk, size_t n)
+{
+  if (!lpb.buf)
+    return;
+  if (lpb.len + n > lpb.max) {
+    size_t max = lpb.max << 1;
+    char * buf = max <= LPB_MAX ? realloc(lpb.buf, max) : 0;
+    if (!buf) {
+      free(lpb.buf);
+      memset(&lpb, 0, sizeof(lpb));
+      return;
+    }
+    lpb.buf = buf;
+    lpb.max = max;
+  }
+  memcpy(lpb.buf+lpb.len, blk, n);
+  lpb.len += n;
+}
+
+/* ----------------------------------------------------------------------
+ * Parallel render
+ * ---------------------------------------------------------------------- */
+
+enum {
+  SEG_MAX  = 256,			/* max snapshots */
+  SEG_TICS = 256,			/* initial ticks per segment */
+  WR_MAX   = 1 << 20			/* max bytes per write */
+};
+
+/* A segment is rendered from a snapshot of the player. The snapshots
+ * share the module.
+ */
+static struct {
+  struct seg {
+    rkpla_t * pla;
+    unsigned long tic;			/* first tick */
+  } seg[SEG_MAX];
+  int nseg;
+  int next;				/* next segment to render */
+  unsigned long len;			/* ticks per segment */
+  unsigned long ntic;			/* ticks to render */
+  rkmod_t * M;				/* module played by the player */
+  target_t * T;
+  char * buf;
+} par;
+
+static void par_free(void)
+{
+  int i;
+  for (i=0; i<par.nseg; ++i)
+    free(par.seg[i].pla);
+  free(par.buf);
+  memset(&par, 0, sizeof(par));
+}
+
+/**
+ * Take a snapshot of the player before tick TIC. When the table is
+ * full every other snapshot is dropped and segments get twice longer.
+ */
+static void par_snap(rkpla_t * P, unsigned long tic)
+{
+  struct seg * S;
+
+  if (par.nseg == SEG_MAX) {
+    int i;
+    for (i=0; i<SEG_MAX; ++i) {
+      if (i & 1)
+	free(par.seg[i].pla);
+      else
+	par.seg[i>>1] = par.seg[i];
+    }
+    par.nseg = SEG_MAX/2;
+    par.len <<= 1;
+    if (tic % par.len)
+      return;
+  }
+  S = par.seg + par.nseg++;
+  S->tic = tic;
+  S->pla = malloc(rk_sizeof(par.M));
+  if (!S->pla || rk_clone(S->pla, P, par.M))
+    abort();
+}
+
+static void * par_worker(void * arg)
+{
+  const target_t * const T = par.T;
+  const int bytes = T->ppt * 4;
+  int i;
+
+  (void) arg;
+
+  while (i = __atomic_fetch_add(&par.next, 1, __ATOMIC_RELAXED),
+	 i < par.nseg) {
+    struct seg * const S = par.seg + i;
+    const unsigned long end = i+1 < par.nseg ? par.seg[i+1].tic : par.ntic;
+    unsigned long tic;
+
+    for (tic = S->tic; tic < end; ++tic) {
+      unsigned long span;
+      rk_play(S->pla);
+      /* Held ticks are mixed at once */
+      span = rk_hold(S->pla, opt_mute);
+      if (span > end - tic - 1)
+	span = end - tic - 1;
+      rk_mix(S->pla, par.buf + tic*bytes, T->ppt * (span+1),
+	     T->spr, opt_mute);
+      while (span--) {
+	rk_play(S->pla);
+	++tic;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Render the song to a single target with NJOBS threads. The player
+ * (playing M) is run without mixing first to take the snapshots. Returns the
+ * number of ticks or -1 on error.
+ */
+static long par_render(rkpla_t * P, rkmod_t * M,
+		       target_t * T, int njobs)
+{
+  unsigned long tic, endtic = 0, pos, size;
+  int i, ended = 0;
+#ifndef WIN32
+  pthread_t tid[njobs];
+#endif
+
+  memset(&par, 0, sizeof(par));
+  par.len = SEG_TICS;
+  par.M	  = M;
+  par.T	  = T;
+
+  for (tic=0;; ++tic) {
+    int evt;
+
+    if (!(tic % par.len))
+      par_snap(P, tic);
+    evt = rk_play(P);
+    if (evt < 0) {
+      emsg("player error (%d/x%02X)\n",evt,255&-evt);
+      par_free();
+      return -1;
+    }
+    if (opt_trace)
+      print_trace(P);
+    if ( (evt & 15) == 15 && !ended ) {
+      ended  = 1;
+      endtic = tic;
+    }
+    if (ended && tic >= endtic * opt_loops)
+      break;
+    rk_skip(P, T->ppt, T->spr, opt_mute);
+  }
+  par.ntic = tic;
+
+  size = par.ntic * T->ppt * 4;
+  par.buf = malloc(size ? size : 1);
+  if (!par.buf) {
+    emsg("not enough memory to render %lu ticks\n", par.ntic);
+    par_free();
+    return -1;
+  }
+
+#ifndef WIN32
+  for (i=1; i<njobs; ++i)
+    if (pthread_create(tid+i, 0, par_worker, 0))
+      break;
+  par_worker(0);
+  while (--i > 0)
+    pthread_join(tid[i], 0);
+#else
+  par_worker(0);
+#endif
+
+  for (pos=0; pos<size; pos+=i) {
+    i = size-pos < WR_MAX ? size-pos : WR_MAX;
+    if (target_write(T, par.buf+pos, i)) {
+      par_free();
+      return -1;
+    }
+  }
+
+  par_free();
+  return tic;
+}
+
+/* ----------------------------------------------------------------------
+ * Overview
+ * ---------------------------------------------------------------------- */
+
+enum {
+  OVW_SPR = 1000,			/* voice advance rate */
+  OVW_MAX = 1 << 20			/* max points */
+};
+
+static void put16(uint8_t * b, unsigned v)
+{
+  b[0] = v; b[1] = v >> 8;
+}
+
+static void put32(uint8_t * b, unsigned long v)
+{
+  put16(b, v); put16(b+2, v >> 16);
+}
+
+/**
+ * Write the waveform overview of the song (NPTS points) to the target
+ * instead of rendering it. The sequencer runs at full precision, the
+ * voices are advanced at OVW_SPR and the levels of each tick estimated
+ * (rk_level()). Returns the number of ticks or -1 on error.
+ */
+static long overview(rkpla_t * P, target_t * T, unsigned rate, int npts)
+{
+  const int ppt = (OVW_SPR + (rate>>1)) / rate;
+  rklvl_t * lvl = 0;
+  uint8_t * out;
+  unsigned long tic, endtic = 0, max = 0, size;
+  int i, ended = 0;
+
+  for (tic=0;; ++tic) {
+    int evt = rk_play(P);
+    if (evt < 0) {
+      emsg("player error (%d/x%02X)\n",evt,255&-evt);
+      free(lvl);
+      return -1;
+    }
+    if ( (evt & 15) == 15 && !ended ) {
+      ended  = 1;
+      endtic = tic;
+    }
+    if (ended && tic >= endtic * opt_loops)
+      break;
+    if (tic == max) {
+      rklvl_t * const tmp = realloc(lvl, (max = max ? max*2 : 4096) *
+				    sizeof(*lvl));
+      if (!tmp) abort();
+      lvl = tmp;
+    }
+    rk_level(P, lvl+tic, ppt > 0 ? ppt : 1, OVW_SPR, opt_mute);
+  }
+
+  /* 20 bytes header then min,max,rms (left,right) per point */
+  size = 20 + npts * 12UL;
+  out = malloc(size);
+  if (!out) abort();
+  memcpy(out, "RKPK", 4);
+  put16(out+4, 1);
+  put16(out+6, 2);
+  put32(out+8, npts);
+  put32(out+12, T->spr);
+  put32(out+16, tic * T->ppt);
+
+  for (i=0; i<npts; ++i) {
+    /* Ticks of the point (at least one) */
+    unsigned long t0 = tic * i / npts, t1 = tic * (i+1) / npts, t;
+    uint8_t * const b = out + 20 + i * 12;
+    int k;
+
+    if (t1 <= t0)
+      t1 = t0 + 1;
+    for (k=0; k<2; ++k) {
+      int lo = 0, hi = 0;
+      double ms = 0, rms;
+      for (t=t0; t<t1 && t<tic; ++t) {
+	if (lvl[t].min[k] < lo)
+	  lo = lvl[t].min[k];
+	if (lvl[t].max[k] > hi)
+	  hi = lvl[t].max[k];
+	ms += lvl[t].ms[k];
+      }
+      rms = sqrt(ms / (t1-t0));
+      put16(b + k*6,   lo);
+      put16(b + k*6+2, hi);
+      put16(b + k*6+4, rms < 32767 ? lrint(rms) : 32767);
+    }
+  }
+  free(lvl);
+
+  i = target_write(T, out, size);
+  free(out);
+  return i ? -1 : (long) tic;
+}
+
+/* ----------------------------------------------------------------------
+ * Cache
+ * ---------------------------------------------------------------------- */
+
+/* Renders are kept in the cache directory (-C) as raw PCM files named
+ * after a hash of the module file and of every option changing the
+ * output. The least recently used ones are removed above the size
+ * limit.
+ */
+static struct {
+  char	 * name;			/* cached render */
+  char	 * tmp;				/* render being cached */
+  FILE	 * fp;
+} cache;
+
+static uint64_t fnv1a(uint64_t h, const void * buf, size_t n)
+{
+  const uint8_t * b = buf;
+  while (n--)
+    h = (h ^ *b++) * 0x100000001B3ull;
+  return h;
+}
+
+/**
+ * Compute the cache entry name of the render of song SONG of module
+ * file PATH at SPR. Returns -1 if the file can not be read.
+ */
+static int cache_key(const char * path, int song, long spr)
+{
+  uint64_t h = 0xCBF29CE484222325ull;
+  char buf[4096];
+  size_t n;
+  FILE * f = fopen(path, "rb");
+
+  if (!f)
+    return -1;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    h = fnv1a(h, buf, n);
+  fclose(f);
+  n = snprintf(buf, sizeof(buf),
+	       "%s|%d|%ld|m%d|i%d|I%d|F%d|l%d|M%d",
+	       rk_version(), song, spr, opt_mute, opt_ignore, opt_interp,
+	       opt_filter, opt_loops, opt_mixrate);
+  h = fnv1a(h, buf, n);
+  if (-1 == asprintf(&cache.name, "%s/%016llx.pcm",
+		     opt_cache, (unsigned long long) h))
+    abort();
+  return 0;
+}
+
+#ifndef WIN32
+
+typedef struct {
+  char * name;
+  off_t size;
+  time_t time;
+} centry_t;
+
+static int centry_cmp(const void * a, const void * b)
+{
+  const centry_t * x = a, * y = b;
+  return x->time < y->time ? -1 : x->time > y->time;
+}
+
+/**
+ * Remove the least recently used entries above the size limit.
+ */
+static void cache_evict(void)
+{
+  const long long max = (long long) opt_cachemax << 20;
+  long long total = 0;
+  centry_t * ent = 0;
+  int i, n = 0, max_ent = 0;
+  struct dirent * d;
+  DIR * dir = opendir(opt_cache);
+
+  if (!dir)
+    return;
+  while ((d = readdir(dir))) {
+    const size_t len = strlen(d->d_name);
+    struct stat st;
+    char * name;
+
+    if (len != 20 || strcmp(d->d_name+16, ".pcm"))
+      continue;
+    if (-1 == asprintf(&name, "%s/%s", opt_cache, d->d_name))
+      abort();
+    if (stat(name, &st)) {
+      free(name);
+      continue;
+    }
+    if (n == max_ent) {
+      centry_t * const tmp =
+	realloc(ent, (max_ent = max_ent ? max_ent*2 : 64) * sizeof(*ent));
+      if (!tmp) abort();
+      ent = tmp;
+    }
+    ent[n].name = name;
+    ent[n].size = st.st_size;
+    ent[n++].time = st.st_mtime;
+    total += st.st_size;
+  }
+  closedir(dir);
+
+  qsort(ent, n, sizeof(*ent), centry_cmp);
+  for (i=0; i<n; ++i) {
+    if (total > max && strcmp(ent[i].name, cache.name) && !unlink(ent[i].name))
+      total -= ent[i].size;
+    free(ent[i].name);
+  }
+  free(ent);
+}
+
+/**
+ * Serve the render from the cache to the target. Returns the number
+ * of bytes, -1 if not cached or -2 on output error.
+ */
+static long cache_play(target_t * T)
+{
+  struct stat st;
+  long pos = 0, n;
+  int fd = open(cache.name, O_RDONLY);
+  const sink_t * const S = T->sink;
+  char * map;
+
+  if (fd == -1)
+    return -1;
+  if (fstat(fd, &st) || st.st_size <= 0 || (st.st_size & 3)) {
+    close(fd);
+    return -1;
+  }
+  utime(cache.name, 0);			/* most recently used */
+
+#ifdef __linux__
+  /* Straight from the page cache to a single file */
+  if (T->nsink == 1 && S->type == OUT_IS_FILE && !S->fifo && !T->ana) {
+    fflush(S->cookie);
+    while (pos < st.st_size &&
+	   (n = sendfile(fileno(S->cookie), fd, 0, st.st_size - pos)) > 0)
+      pos += n;
+    if (pos == st.st_size) {
+      close(fd);
+      return pos;
+    }
+  }
+#endif
+
+  map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return pos ? -2 : -1;
+  for ( ; pos<st.st_size; pos+=n) {
+    n = st.st_size-pos < WR_MAX ? st.st_size-pos : WR_MAX;
+    if (target_write(T, map+pos, n)) {
+      munmap(map, st.st_size);
+      return -2;
+    }
+  }
+  munmap(map, st.st_size);
+  return pos;
+}
+
+/**
+ * Start writing the render through to a temporary cache file.
+ */
+static void cache_begin(void)
+{
+  int fd;
+
+  if (-1 == asprintf(&cache.tmp, "%s/.rkplay-XXXXXX", opt_cache))
+    abort();
+  fd = mkstemp(cache.tmp);
+  if (fd == -1 || !(cache.fp = fdopen(fd, "wb"))) {
+    emsg("cache disabled (%d) %s -- %s\n",
+	 errno, strerror(errno), cache.tmp);
+    if (fd != -1)
+      close(fd);
+    free(cache.tmp);
+    cache.tmp = 0;
+  }
+}
+
+/**
+ * Finish the cache file: it enters the cache under its name if OK or
+ * is deleted otherwise.
  */
-static void print_version(void)
+static void cache_end(int ok)
 {
-  printf("%s"
-#ifndef NDEBUG
-	 " (DEBUG BUILD)"
+  if (cache.fp) {
+    ok &= !fclose(cache.fp);
+    cache.fp = 0;
+    if (ok && !rename(cache.tmp, cache.name))
+      cache_evict();
+    else
+      unlink(cache.tmp);
+  }
+  free(cache.tmp);
+  free(cache.name);
+  cache.tmp = cache.name = 0;
+}
+
+#else
+
+static long cache_play(target_t * T) { return -1; }
+static void cache_begin(void) { }
+static void cache_end(int ok) { free(cache.name); cache.name = 0; }
+
 #endif
-	 "\n", rk_version());
-  puts(copyright);
-  puts(license);
+
+static void cache_write(const void * blk, int bytes)
+{
+  if (cache.fp && fwrite(blk, 1, bytes, cache.fp) != (size_t) bytes) {
+    /* The render goes on uncached */
+    fclose(cache.fp);
+    cache.fp = 0;
+    unlink(cache.tmp);
+  }
 }
 
 /* ----------------------------------------------------------------------
- * Writers
+ * Playlist
  * ---------------------------------------------------------------------- */
 
-static FILE * infofile = 0;
+enum {
+  PRE_MS   = 1000,			/* prerendered start of an entry */
+  XFADE_MAX = 10000			/* max crossfade (ms) */
+};
 
-void rklog_va(const char * fmt, va_list list)
+/* A playlist entry. The next one is loaded and its start rendered by
+ * a thread while the current one plays.
+ */
+typedef struct entry entry_t;
+struct entry {
+  char	      * path;
+  int		song;			/* song number (1-based) */
+  rkmod_t     * mod;
+  rkpla_t     * pla;
+  int		frq;			/* tick rate */
+  int		ppt;			/* frames per tick */
+  int		ended;
+  unsigned long tics, endtic;
+  int		err;			/* load error or player error */
+  int16_t     * pre;			/* prerendered start */
+  long		npre;			/* its length in frames */
+  int		run;			/* loading thread running */
+#ifndef WIN32
+  pthread_t	tid;
+#endif
+};
+
+static struct {
+  entry_t * ent;
+  int	    n;
+  long	    spr;			/* output rate */
+  long	    xfade;			/* crossfade (frames) */
+  int16_t * tail;			/* delayed end of the entry */
+  long	    ntail;			/* its length in frames */
+} pls;
+
+/**
+ * Split "FILE#N" in FILE and song number N (default 1).
+ */
+static char * entry_spec(const char * arg, int * song)
 {
-  assert(infofile);
-  if (infofile)
-    vfprintf(infofile,fmt,list);
+  const char * s = strrchr(arg, '#');
+  char * path;
+
+  *song = 1;
+  if (s && s[1] && strspn(s+1, "0123456789") == strlen(s+1)) {
+    *song = atoi(s+1);
+    path = strndup(arg, s-arg);
+  } else
+    path = strdup(arg);
+  if (!path) abort();
+  return path;
 }
 
-void rklog(const char * fmt, ...)
+/**
+ * Load and init an entry. Returns RK_OK or RK_INP.
+ */
+static int entry_open(entry_t * E)
 {
-  va_list list;
-  va_start(list,fmt);
-  rklog_va(fmt,list);
-  va_end(list);
+  int frq;
+
+  E->mod = rk_load(E->path, &E->err);
+  if (!E->mod)
+    return RK_INP;
+  E->pla = malloc(rk_sizeof(E->mod));
+  if (!E->pla) abort();
+  frq = rk_init(E->pla, E->mod, E->song);
+  if (frq < 0) {
+    E->err = -1;
+    return RK_INP;
+  }
+  rk_interp(E->pla, opt_interp);
+  rk_ignore(E->pla, opt_ignore);
+  rk_filter(E->pla, opt_filter);
+  E->frq = frq;
+  E->ppt = (pls.spr + (frq>>1)) / frq;
+  return RK_OK;
 }
 
-static int emsg(const char * fmt, ...)
+static void entry_free(entry_t * E)
 {
-  va_list list;
-  va_start(list, fmt);
-  fprintf(stderr, "%s: ", prgname);
-  vfprintf(stderr, fmt, list);
-  va_end(list);
-  fflush(stderr);
-  return RK_ERR;
+  free(E->pla);
+  free(E->mod);
+  free(E->pre);
+  E->pla = 0;
+  E->mod = 0;
+  E->pre = 0;
 }
 
-static int
-null_write(const void * data, void * cookie, int n)
+/**
+ * Report and drop an entry that failed to open.
+ */
+static void entry_skip(entry_t * E)
 {
-  return n;
+  emsg("skipped (error %d) -- %s#%d\n", E->err, E->path, E->song);
+  entry_free(E);
 }
 
-static int
-file_write(const void * data, void * cookie, int n)
+/**
+ * Play and mix one tick of an entry like the single song loop does.
+ * Returns the number of frames, 0 at the end or -1 on error.
+ */
+static int entry_tick(entry_t * E, void * mix)
 {
-  return fwrite(data,1,n,cookie);
+  const int evt = rk_play(E->pla);
+
+  if (evt < 0) {
+    E->err = evt;
+    return -1;
+  }
+  if ( (evt & 15) == 15 && !E->ended ) {
+    E->ended  = 1;
+    E->endtic = E->tics;
+  }
+  if (E->ended && E->tics >= E->endtic * opt_loops)
+    return 0;
+  rk_mix(E->pla, mix, E->ppt, pls.spr, opt_mute);
+  ++E->tics;
+  return E->ppt;
 }
 
-static int
-live_write(const void * data, void * cookie, int n)
+/**
+ * Load an entry and render its start (at least the crossfade).
+ */
+static void * entry_thread(void * arg)
 {
-  return ao_play(cookie, (void*)data, n) == 0
-    ? 0 : n;
+  entry_t * const E = arg;
+  long max;
+  int n;
+
+  if (entry_open(E))
+    return 0;
+  max = pls.xfade + pls.spr * PRE_MS / 1000;
+  E->pre = malloc( (max + E->ppt) * 4 );
+  if (!E->pre) abort();
+  while (E->npre < max &&
+	 (n = entry_tick(E, E->pre + E->npre*2)) > 0)
+    E->npre += n;
+  return 0;
+}
+
+#ifndef WIN32
+
+static void entry_start(entry_t * E)
+{
+  E->run = !pthread_create(&E->tid, 0, entry_thread, E);
+  if (!E->run)
+    entry_thread(E);
+}
+
+static void entry_wait(entry_t * E)
+{
+  if (E->run)
+    pthread_join(E->tid, 0);
+  E->run = 0;
+}
+
+#else
+
+static void entry_start(entry_t * E) { entry_thread(E); }
+static void entry_wait(entry_t * E) { }
+
+#endif
+
+/**
+ * Send frames through the crossfade delay: the last pls.xfade frames
+ * are held back to be mixed with the start of the next entry.
+ */
+static int list_write(target_t * T, const int16_t * dat, long n)
+{
+  const long keep = pls.xfade;
+  long a, b;
+
+  if (!keep)
+    return target_write(T, dat, n*4);
+  if (pls.ntail + n <= keep) {
+    memcpy(pls.tail + pls.ntail*2, dat, n*4);
+    pls.ntail += n;
+    return 0;
+  }
+  /* Write the A oldest frames of the tail and the B first of DAT */
+  b = pls.ntail + n - keep;
+  a = b < pls.ntail ? b : pls.ntail;
+  b -= a;
+  if (target_write(T, pls.tail, a*4) || target_write(T, dat, b*4))
+    return -1;
+  memmove(pls.tail, pls.tail + a*2, (pls.ntail-a)*4);
+  memcpy(pls.tail + (pls.ntail-a)*2, dat + b*2, (n-b)*4);
+  pls.ntail = keep;
+  return 0;
+}
+
+/**
+ * Start an entry with its prerendered frames, crossfaded with the
+ * tail of the previous one.
+ */
+static int list_fade(target_t * T, entry_t * E)
+{
+  const long n = pls.ntail;
+  int16_t * const out = n <= E->npre ? E->pre : pls.tail;
+  long f;
+  int i;
+
+  for (f=0; f<n; ++f) {
+    const float g = (f + 0.5f) / n;
+    for (i=0; i<2; ++i) {
+      const float v = pls.tail[2*f+i] * (1.0f-g) +
+	(f < E->npre ? E->pre[2*f+i] * g : 0.0f);
+      out[2*f+i] = lrintf(v);
+    }
+  }
+  pls.ntail = 0;
+  if (out == pls.tail)
+    return target_write(T, out, n*4); /* shorter than the crossfade */
+  return list_write(T, E->pre, E->npre);
 }
 
-static void * cookie;
-static int (* writer)(const void *, void *, int n);
+/**
+ * Play the entries from FIRST gapless to the target T. The entries
+ * before FIRST were skipped and FIRST is already loaded. Returns RK_OK
+ * or an error code.
+ */
+static int play_list(target_t * T, int first)
+{
+  int j, ecode = first ? RK_INP : RK_OK;
+
+  if (pls.xfade) {
+    pls.tail = malloc(pls.xfade * 4);
+    if (!pls.tail) abort();
+  }
+
+  for (j=first; j<pls.n; ++j) {
+    entry_t * const E = pls.ent+j;
+    unsigned long msecs;
+    int n;
+
+    entry_wait(E);
+    if (j+1 < pls.n)
+      entry_start(E+1);
+    if (!E->pla || E->err) {
+      entry_skip(E);
+      ecode = RK_INP;
+      continue;
+    }
+
+    if (j > first && list_fade(T, E)) {
+      ecode = RK_OUT;
+      break;
+    }
+    while (!E->ended || E->tics < E->endtic * opt_loops) {
+      if (lat_signaled) {
+	lat_signaled = 0;
+	lat_report(stderr);
+      }
+      lat_begin();
+      n = entry_tick(E, T->mix);
+      if (n < 0) {
+	emsg("player error (%d/x%02X) -- %s#%d\n",
+	     E->err, 255&-E->err, E->path, E->song);
+	ecode = RK_ERR;
+	break;
+      }
+      if (!n)
+	break;
+      lat_done();
+      if (list_write(T, T->mix, n)) {
+	ecode = RK_OUT;
+	break;
+      }
+    }
+    if (ecode == RK_OUT)
+      break;
+    msecs = 1000UL * E->tics * E->ppt / pls.spr;
+    rklog("play   : %s#%d %u'%02u,%03u\" (%lu ticks)\n",
+	  E->path, E->song,
+	  (unsigned int)(msecs/60000u), (unsigned int)(msecs/1000u%60u),
+	  (unsigned int)(msecs%1000UL), E->tics);
+    entry_free(E);
+  }
+  if (pls.ntail && ecode != RK_OUT &&
+      target_write(T, pls.tail, pls.ntail*4))
+    ecode = RK_OUT;
+
+  for (j=0; j<pls.n; ++j) {
+    entry_wait(pls.ent+j);
+    entry_free(pls.ent+j);
+  }
+  free(pls.tail);
+  pls.tail = 0;
+  pls.ntail = 0;
+  return ecode;
+}
 
 /* ----------------------------------------------------------------------
  * Main
@@ -234,7 +1740,7 @@ static int (* writer)(const void *, void *, int n);
 int main(int argc, char **argv)
 {
   /* Options */
-  static char sopts[] = "hV"  "wcno:" "r:m:i:" "s" ;
+  static char sopts[] = "hV"  "wcnSo:t:" "r:m:i:" "sRl:I:F:Tj:aM:X:W:C:K:" ;
   static struct option lopts[] = {
     { "help",	 0, 0, 'h' },
     { "usage",	 0, 0, 'h' },
@@ -243,25 +1749,40 @@ int main(int argc, char **argv)
     { "output",	 1, 0, 'o' },
     { "stdout",	 0, 0, 'c' },
     { "null",	 0, 0, 'n' },
+    { "shm",	 0, 0, 'S' },
+    { "tee=",	 1, 0, 't' },
     { "rate=",	 1, 0, 'r' },
     { "mute=",	 1, 0, 'm' },
     { "ignore=", 1, 0, 'i' },
     { "stats",	 0, 0, 's' },
+    { "realtime",0, 0, 'R' },
+    { "loops=",	 1, 0, 'l' },
+    { "interp=", 1, 0, 'I' },
+    { "filter=", 1, 0, 'F' },
+    { "trace",	 0, 0, 'T' },
+    { "jobs=",	 1, 0, 'j' },
+    { "analyze", 0, 0, 'a' },
+    { "mixrate=",1, 0, 'M' },
+    { "xfade=",	 1, 0, 'X' },
+    { "overview=",1,0, 'W' },
+    { "cache=",	 1, 0, 'C' },
+    { "cache-size=",1,0,'K' },
     { 0 }
   };
 
   /* libao */
   int		    aoini = 0;
-  ao_device	   *aodev = 0;
-  ao_info	   *aoinf = 0;
-  ao_sample_format  aofmt;
-  int		    aoid;
 
-  int i=1, n, ecode = RK_ERR, c, ppt;
+  int i=1, n, ecode = RK_ERR, c, first = 0;
   rkpla_t * P = 0;
   rkmod_t * M = 0;
-  void	  * mix = 0;
   unsigned long tics ,msecs, rate;
+  unsigned long endtic = 0, lptic = 0, lplen = 0;
+  int ended = 0, ippt = 0, hold, span;
+  int16_t * imix = 0;
+  const char * iblk = 0;
+  long cached = -1;
+  void * stats = 0, * wraps = 0;
 
   prgname = basename(argv[0]);
   if (!prgname) prgname = argv[0];
@@ -272,9 +1793,60 @@ int main(int argc, char **argv)
     case 'h': print_usage(); return RK_OK;
     case 'V': print_version(); return RK_OK;
     case 's': opt_stats = 1; break;
+    case 'R': opt_realtime = 1; break;
+    case 'T': opt_trace = 1; break;
+    case 'a':
+      opt_analyze = 1;
+      if (opt_outtype == OUT_IS_LIVE)
+	opt_outtype = OUT_IS_NULL;
+      break;
+    case 'l': {
+      char * errp = optarg;
+      opt_loops = mystrtoul(&errp, 0);
+      if (opt_loops < 1 || *errp) {
+	emsg("invalid number of loops -- loops=%s\n", optarg);
+	RETURN (RK_ARG);
+      }
+    } break;
+    case 'j': {
+      char * errp = optarg;
+      opt_jobs = mystrtoul(&errp, 0);
+      if (opt_jobs < 1 || opt_jobs > 256 || *errp) {
+	emsg("invalid number of jobs -- jobs=%s\n", optarg);
+	RETURN (RK_ARG);
+      }
+    } break;
+    case 't': {
+      const char * uri = strchr(optarg, ':');
+      const int len = uri ? (int) (uri - optarg) : (int) strlen(optarg);
+      const int ntypes = sizeof(typename) / sizeof(*typename);
+      int type;
+#ifdef WIN32
+      /* No writer threads */
+      emsg("additional sinks are not supported on this platform"
+	   " -- tee=%s\n", optarg);
+      RETURN (RK_ARG);
+#endif
+      for (type=0; type<ntypes; ++type)
+	if (len == (int) strlen(typename[type]) &&
+	    !strncasecmp(optarg, typename[type], len))
+	  break;
+      if (type == ntypes || (type == OUT_IS_WAVE && !uri)) {
+	emsg("invalid sink -- tee=%s\n", optarg);
+	RETURN (RK_ARG);
+      }
+      if (ntees == MAX_SINKS-1) {
+	emsg("too many sinks -- tee=%s\n", optarg);
+	RETURN (RK_ARG);
+      }
+      tees[ntees].type = type;
+      tees[ntees].uri  = uri && strcmp(uri+1,"-") ? strdup(uri+1) : 0;
+      ntees++;
+    } break;
     case 'w': opt_outtype = OUT_IS_WAVE; break;
     case 'n': opt_outtype = OUT_IS_NULL; break;
     case 'c': opt_outtype = OUT_IS_FILE; break;
+    case 'S': opt_outtype = OUT_IS_SHM; break;
     case 'o':
       if (!opt_output) {
 	if (opt_outtype == OUT_IS_LIVE)
@@ -288,20 +1860,77 @@ int main(int argc, char **argv)
       break;
     case 'r': {
       char * errp = optarg;
-      opt_spr = mystrtoul(&errp, 0);
-      if (opt_spr == -1) {
-	emsg("invalid sampling rate -- rate=%s\n", optarg);
+      ntargets = 0;
+      do {
+	long spr;
+	if (ntargets == MAX_TARGETS) {
+	  emsg("too many sampling rates -- rate=%s\n", optarg);
+	  RETURN (RK_ARG);
+	}
+	spr = str_rate(&errp);
+	if (spr == -1) {
+	  emsg("invalid sampling rate -- rate=%s\n", optarg);
+	  RETURN (RK_ARG);
+	}
+	if (spr < SPR_MIN || spr > SPR_RSP || (*errp && *errp != ',')) {
+	  emsg("sampling rate out of range -- rate=%s\n", optarg);
+	  RETURN (RK_ARG);
+	}
+	targets[ntargets++].spr = spr;
+      } while (*errp++);
+    } break;
+    case 'M': {
+      char * errp = optarg;
+      opt_mixrate = str_rate(&errp);
+      if (opt_mixrate < SPR_MIN || opt_mixrate > SPR_MAX || *errp) {
+	emsg("mix rate out of range -- mixrate=%s\n", optarg);
+	RETURN (RK_ARG);
+      }
+    } break;
+    case 'X': {
+      char * errp = optarg;
+      opt_xfade = mystrtoul(&errp, 0);
+      if (opt_xfade < 0 || opt_xfade > XFADE_MAX || *errp) {
+	emsg("invalid crossfade -- xfade=%s\n", optarg);
+	RETURN (RK_ARG);
+      }
+    } break;
+    case 'W': {
+      char * errp = optarg;
+      opt_overview = mystrtoul(&errp, 0);
+      if (opt_overview < 1 || opt_overview > OVW_MAX || *errp) {
+	emsg("invalid number of points -- overview=%s\n", optarg);
 	RETURN (RK_ARG);
       }
-      if (tolower(*errp) == 'k') {
-	opt_spr *= 1000u;
-	errp++;
+    } break;
+    case 'C':
+      free(opt_cache);
+      opt_cache = strdup(optarg);
+      if (!opt_cache) abort();
+      break;
+    case 'K': {
+      char * errp = optarg;
+      opt_cachemax = mystrtoul(&errp, 0);
+      if (opt_cachemax < 0 || *errp) {
+	emsg("invalid cache size -- cache-size=%s\n", optarg);
+	RETURN (RK_ARG);
       }
-      if (opt_spr < 6000 || opt_spr > 96000) {
-	emsg("sampling rate out of range -- rate=%s\n", optarg);
+    } break;
+    case 'I': {
+      static const char * const modes[] = { "none", "linear", "quadratic" };
+      const int len = strlen(optarg);
+      for (opt_interp = 0; opt_interp < 3; ++opt_interp)
+	if (len && !strncasecmp(optarg, modes[opt_interp], len))
+	  break;
+      if (opt_interp == 3) {
+	emsg("invalid interpolation -- interp=%s\n", optarg);
 	RETURN (RK_ARG);
       }
     } break;
+    case 'F':
+      if (-1 == (opt_filter = str_filter(optarg)))
+	RETURN (RK_ARG);
+      break;
     case 'm':
       if (-1 == (opt_mute = uint_mute(optarg,"mute")))
 	RETURN (RK_ARG);
@@ -324,133 +1953,348 @@ int main(int argc, char **argv)
     RETURN (RK_ARG);
   }
 
-  if (optind != argc-1) {
-    emsg("too many arguments. Try --help\n");
+  pls.n = argc - optind;
+  pls.ent = calloc(pls.n, sizeof(*pls.ent));
+  if (!pls.ent) abort();
+  for (i=0; i<pls.n; ++i)
+    pls.ent[i].path = entry_spec(argv[optind+i], &pls.ent[i].song);
+  opt_input = pls.ent[0].path;
+  if (!ntargets)
+    targets[ntargets++].spr = SPR_DEF;
+  if (ntargets > 1 &&
+      ( opt_outtype == OUT_IS_LIVE ||
+	(opt_outtype == OUT_IS_FILE && !opt_output) ) ) {
+    emsg("multiple sampling rates require a file output\n");
+    RETURN (RK_ARG);
+  }
+  if (ntees && ntargets > 1) {
+    emsg("additional sinks require a single sampling rate\n");
+    RETURN (RK_ARG);
+  }
+  if (opt_jobs > 1 &&
+      (ntargets > 1 || opt_outtype == OUT_IS_LIVE ||
+       opt_filter != RK_FILTER_NONE)) {
+    emsg("multiple jobs require a single rate file output without filter\n");
+    RETURN (RK_ARG);
+  }
+  if (opt_jobs > 1 && opt_mixrate) {
+    emsg("multiple jobs can not be used with a mix rate\n");
+    RETURN (RK_ARG);
+  }
+  if (pls.n > 1 &&
+      (ntargets > 1 || opt_jobs > 1 || opt_mixrate || opt_stats ||
+       opt_trace)) {
+    emsg("a playlist requires a single rate without -j, -M, -s or -T\n");
+    RETURN (RK_ARG);
+  }
+  if (opt_overview) {
+    if (pls.n > 1 || ntargets > 1 || ntees || opt_jobs > 1 ||
+	opt_mixrate) {
+      emsg("an overview requires a single song and rate"
+	   " without -j, -M or -t\n");
+      RETURN (RK_ARG);
+    }
+    opt_outtype = OUT_IS_FILE;
+  }
+  if (opt_realtime && (opt_outtype != OUT_IS_LIVE || pls.n > 1)) {
+    emsg("realtime mode requires a single song and a live output\n");
     RETURN (RK_ARG);
   }
+  for (i=0; i<ntargets && !opt_mixrate; ++i)
+    if (targets[i].spr > SPR_MAX) {
+      emsg("sampling rate above %u requires a mix rate -- rate=%ld\n",
+	   SPR_MAX, targets[i].spr);
+      RETURN (RK_ARG);
+    }
 
-  opt_input = argv[optind];
   if (opt_outtype == OUT_IS_WAVE && !opt_output) {
     /* Generate .wav filename */
     char * b = basename(opt_input);
     char * e = strrchr(b,'.');
     int len = e ? (e - b) : strlen(b);
-    opt_output = malloc(len);
+    opt_output = malloc(len+5);
     if (!opt_output) abort();
     memcpy(opt_output,b,len);
     memcpy(opt_output+len,".wav",5);
   }
 
-  M = rk_load(opt_input, &ecode);
-  if (!M) {
-    emsg("load error(%d) -- %s\n", ecode, opt_input);
-    RETURN (RK_INP);
-  }
+  if (pls.n > 1) {
+    /* Entries are opened alike: those failing are skipped and the
+     * first one that opens sets the rate */
+    for (first=0; first<pls.n && entry_open(pls.ent+first); ++first)
+      entry_skip(pls.ent+first);
+    if (first == pls.n)
+      RETURN (RK_INP);
+    M = pls.ent[first].mod;
+    P = pls.ent[first].pla;
+    n = pls.ent[first].frq;
+  } else {
+    M = rk_load(opt_input, &ecode);
+    if (!M) {
+      emsg("load error(%d) -- %s\n", ecode, opt_input);
+      RETURN (RK_INP);
+    }
 
-  P = malloc(rk_sizeof());
-  if (!P) abort();
+    P = malloc(rk_sizeof(M));
+    if (!P) abort();
 
-  rate = rk_init(P,M,1);
-  if (rate < 0) {
-    emsg("init error -- %s#%u\n",opt_input,1);
-    RETURN (RK_INP);
+    n = rk_init(P,M,pls.ent[0].song);
+    if (n < 0) {
+      emsg("init error -- %s#%u\n",opt_input,pls.ent[0].song);
+      RETURN (RK_INP);
+    }
   }
+  rate = n;
 
-  ppt = (opt_spr+(rate>>1)) / rate;
-  mix = malloc( ppt * 4 );
-  if (!mix) abort();
-
-  switch (opt_outtype) {
-  case OUT_IS_NULL:
-    writer = null_write;
-    opt_output = strdup("");
-    break;
-  case OUT_IS_FILE:
-    writer = file_write;
-    if (opt_output)
-      cookie = fopen(opt_output,"wb");
-    else {
-#if (defined WIN32 || defined _WIN32) && defined _O_BINARY
-      int fd = fileno(stdout);
-      if (fd != -1)
-	_setmode(fd, _O_BINARY);
-#endif
-      opt_output = strdup("<stdout>");
-      if (!opt_output) abort();
-      infofile = stderr;
-      cookie = stdout;
-    }
-    break;
+  rk_interp(P, opt_interp);
+  rk_ignore(P, opt_ignore);
+  rk_filter(P, opt_filter);
+  if (opt_trace && rk_trace(P, trcbuf, sizeof(trcbuf)/sizeof(*trcbuf)))
+    emsg("event trace is not supported\n");
+  if (opt_stats) {
+    stats = malloc(rk_stats_sizeof());
+    if (!stats) abort();
+    rk_stats(P, stats);
+  }
 
-  case OUT_IS_LIVE: case OUT_IS_WAVE:
+  aoini = opt_outtype == OUT_IS_LIVE || opt_outtype == OUT_IS_WAVE;
+  for (i=0; i<ntees; ++i)
+    aoini |= tees[i].type == OUT_IS_LIVE || tees[i].type == OUT_IS_WAVE;
+  if (aoini)
     ao_initialize();
-    aoini = 1;
-    memset(&aofmt,0,sizeof(aofmt));
-    aofmt.bits	      = 16;
-    aofmt.rate	      = opt_spr;
-    aofmt.channels    = 2;
-    aofmt.byte_format = AO_FMT_NATIVE;
 
-    if (opt_outtype == OUT_IS_WAVE) {
-      aoid  = ao_driver_id("wav");
-      aodev = ao_open_file(aoid, opt_output, 1, &aofmt, 0);
-    } else {
-      aoid  = ao_default_driver_id();
-      aodev = ao_open_live(aoid, &aofmt, 0);
+  if (opt_mixrate) {
+    /* A single mix shared by all targets */
+    ippt = (opt_mixrate+(rate>>1)) / rate;
+    imix = malloc( ippt * 4 * HOLD_MAX );
+    if (!imix) abort();
+  }
+
+  for (i=0; i<ntargets; ++i) {
+    target_t * const T = targets+i;
+    char * output;
+    int j;
+
+    T->ppt = (T->spr+(rate>>1)) / rate;
+    if (!opt_mixrate) {
+      T->mix = malloc( T->ppt * 4 * HOLD_MAX );
+      if (!T->mix) abort();
     }
-    aoinf = ao_driver_info(aoid);
-    if (!aodev) {
-      emsg("failed to open audio device -- %s\n", aoinf->short_name);
-      RETURN ( RK_OUT );
+    if (i > 0 && !opt_mixrate) {
+      T->mixer = malloc(rk_mixer_sizeof());
+      if (!T->mixer) abort();
+      rk_mixer_init(T->mixer, P);
+    }
+    output = 0;
+    if (ntargets > 1 && (opt_output || opt_outtype == OUT_IS_SHM)) {
+      /* One object per rate, a ring has a single producer */
+      output = rate_name(opt_output ? opt_output : shmname, T->spr);
+      if (!output) abort();
     }
-    opt_spr = aofmt.rate;
-
-    if (aoinf->type == AO_TYPE_LIVE &&
-	-1 == asprintf(&opt_output, "%s@%uhz",aoinf->short_name,opt_spr))
-      opt_output = 0;
-    if (!opt_output) abort();
 
-    cookie = aodev;
-    writer = live_write;
+    ecode = sink_open(T->sink, opt_outtype,
+		      output ? output : opt_output, &T->spr);
+    free(output);
+    T->nsink = 1;
+    if (ecode)
+      RETURN ( ecode );
+    for (j=0; j<ntees; ++j) {
+      long spr = T->spr;
+      if ( (ecode = sink_open(T->sink+T->nsink++, tees[j].type,
+			      tees[j].uri, &spr)) )
+	RETURN ( ecode );
+    }
+    /* Only the first sink paces the render */
+    for (j=1; j<T->nsink; ++j)
+      if (T->sink[j].type != OUT_IS_NULL)
+	fifo_start(T->sink+j);
+    if (opt_analyze && !(T->ana = rk_ana_new(T->spr)))
+      abort();
+    if (opt_mixrate) {
+      T->ppt = (T->spr+(rate>>1)) / rate;
+      T->rsp = rk_rsp_new(opt_mixrate, T->spr);
+      if (!T->rsp) abort();
+      T->mix = malloc( rk_rsp_max(T->rsp, ippt * HOLD_MAX) * 4 );
+      if (!T->mix) abort();
+    }
   }
-  assert(opt_output);
 
+  /* Keep stdout for the analysis */
   if (!infofile)
-    infofile = stdout;
+    infofile = opt_analyze ? stderr : stdout;
 
   rklog("input  : %s\n", opt_input);
-  rklog("output : %s: %s\n",typename[opt_outtype],opt_output);
+  for (i=0; i<ntargets; ++i) {
+    int j;
+    for (j=0; j<targets[i].nsink; ++j)
+      rklog("output : %s: %s\n",
+	    typename[targets[i].sink[j].type], targets[i].sink[j].output);
+  }
 
-  for (tics=msecs=0;;++tics) {
-    int evt = rk_play(P);
-    if (evt < 0) {
-      emsg("player error (%d/x%02X)\n",evt,255&-evt);
-      RETURN ( RK_ERR );
+  if (opt_outtype == OUT_IS_LIVE)
+    lat_init(targets[0].spr, targets[0].ppt, targets[0].sink[0].cookie);
+
+  /* Held ticks are mixed at once unless each tick matters */
+  hold = opt_outtype != OUT_IS_LIVE && !opt_stats;
+
+  /* Loops are repeated from memory with a single mix only. The buffer
+   * grows as the song plays: not in realtime mode. */
+  if (opt_loops > 1 && (ntargets == 1 || opt_mixrate) && pls.n < 2 &&
+      !opt_realtime) {
+    lpb.buf = malloc(lpb.max = 1 << 20);
+    wraps = malloc(rk_loop_sizeof());
+    if (!lpb.buf || !wraps) abort();
+    rk_loop_detect(P, wraps);
+  }
+
+  /* A single rate render is served from the cache or written to it */
+  if (opt_cache && ntargets == 1 && pls.n < 2 && !opt_overview &&
+      !opt_stats && !opt_trace && opt_outtype != OUT_IS_LIVE) {
+    if (cache_key(opt_input, pls.ent[0].song, targets[0].spr))
+      emsg("cache disabled -- %s\n", opt_input);
+    else {
+      cached = cache_play(targets);
+      if (cached == -2)
+	RETURN (RK_OUT);
+      if (cached < 0)
+	cache_begin();
+      rklog("cache  : %s %s\n", cached < 0 ? "miss" : "hit", cache.name);
     }
-    /* if (evt & 0xFF0) rklog("%05lu %3X\n", tics, evt); */
+  }
+
+  /* Nothing is allocated from now on in realtime mode */
+  if (opt_realtime)
+    rt_enter(targets[0].mix, targets[0].ppt*4);
+
+  if (cached >= 0) {
+    tics  = cached / 4 / targets[0].ppt;
     msecs = 1000UL * tics / rate;
-    if ( (evt & 15) == 15)
-      break;
-    rk_mix(P, mix, ppt, opt_spr, opt_mute);
-    errno = 0;
-    if ( writer(mix, cookie, ppt*4) != ppt*4 ) {
-      if (!errno)
-	emsg("write error\n");
-      else
-	emsg("write error (%d) %s\n", errno,strerror(errno));
-      RETURN( RK_OUT );
+  } else if (opt_overview) {
+    const long n = overview(P, targets, rate, opt_overview);
+    if (n < 0)
+      RETURN ( RK_ERR );
+    tics  = n;
+    msecs = 1000UL * tics / rate;
+  } else if (opt_jobs > 1) {
+    const long n = par_render(P, M, targets, opt_jobs);
+    if (n < 0)
+      RETURN ( RK_ERR );
+    tics  = n;
+    msecs = 1000UL * tics / rate;
+  } else if (pls.n > 1) {
+    /* The first entry opened is the song already loaded */
+    pls.spr   = targets[0].spr;
+    pls.xfade = opt_xfade * pls.spr / 1000;
+    pls.ent[first].ppt = targets[0].ppt;
+    P = 0;
+    M = 0;
+    ecode = play_list(targets, first);
+    if (ecode == RK_OUT)
+      RETURN (ecode);
+    tics = msecs = 0;
+  } else {
+    for (tics=msecs=0;;tics+=span+1) {
+
+      if (lat_signaled) {
+	lat_signaled = 0;
+	lat_report(stderr);
+      }
+      lat_begin();
+
+      /* Once the loop is known the player only runs to find the end */
+      if (!lplen || !ended) {
+	int evt = rk_play(P);
+	if (evt < 0) {
+	  emsg("player error (%d/x%02X)\n",evt,255&-evt);
+	  RETURN ( RK_ERR );
+	}
+	if (opt_trace)
+	  print_trace(P);
+	if ( (evt & 15) == 15 && !ended ) {
+	  ended  = 1;
+	  endtic = tics;
+	}
+	if (!lplen && lpb.buf && (lplen = rk_loop(P, 0)))
+	  lptic = tics;
+      }
+      msecs = 1000UL * tics / rate;
+      if (ended && tics >= endtic * opt_loops)
+	break;
+
+      /* The following ticks leaving the mix unchanged are played now
+       * and mixed along with this one.
+       */
+      span = 0;
+      if (hold && !lplen) {
+	span = rk_hold(P, opt_mute);
+	if (span > HOLD_MAX-1)
+	  span = HOLD_MAX-1;
+	if (ended && tics + span >= endtic * opt_loops)
+	  span = endtic * opt_loops - tics - 1;
+	for (i=0; i<span; ++i)
+	  rk_play(P);
+      }
+
+      if (imix) {
+	/* Mix once, convert for each target */
+	iblk = (const char *) imix;
+	if (lplen)
+	  iblk = lpb.buf + (lptic-lplen + (tics-lptic) % lplen) * ippt*4;
+	else {
+	  rk_mix(P, imix, ippt * (span+1), opt_mixrate, opt_mute);
+	  lpb_push(imix, ippt*4 * (span+1));
+	}
+      }
+
+      for (i=0; i<ntargets; ++i) {
+	target_t * const T = targets+i;
+	int bytes = T->ppt * 4 * (span+1);
+	const char * blk = T->mix;
+
+	if (T->rsp)
+	  bytes = rk_rsp_run(T->rsp, T->mix, iblk, ippt * (span+1)) * 4;
+	else if (lplen)
+	  blk = lpb.buf + (lptic-lplen + (tics-lptic) % lplen) * bytes;
+	else {
+	  if (T->mixer)
+	    rk_mix_to(P, T->mixer, T->mix, T->ppt * (span+1), T->spr,
+		      opt_mute);
+	  else
+	    rk_mix(P, T->mix, T->ppt * (span+1), T->spr, opt_mute);
+	  lpb_push(T->mix, bytes);
+	}
+	lat_done();
+	if (target_write(T, blk, bytes))
+	  RETURN( RK_OUT );
+      }
+    }
+
+    /* Resampler tails */
+    for (i=0; i<ntargets; ++i) {
+      target_t * const T = targets+i;
+      if (T->rsp &&
+	  target_write(T, T->mix, rk_rsp_run(T->rsp, T->mix, 0, 0) * 4))
+	RETURN( RK_OUT );
     }
   }
 
-  if (1) {
+  cache_end(1);
+
+  if (pls.n < 2) {
     unsigned long secs = msecs / 1000UL;
     rklog("length : %u'%02u,%03u\" (%lu ticks at %uHz) \n",
 	  (unsigned int)(secs/60u),
 	  (unsigned int)(secs%60u),
 	  (unsigned int)(msecs%1000UL),
 	  tics, rate);
+    if (lplen)
+      rklog("loop   : %lu ticks repeated from tick %lu\n",
+	    lplen, lptic-lplen);
   }
 
+  for (i=0; opt_analyze && i<ntargets; ++i)
+    print_analysis(targets+i);
+
   if (opt_stats) {
     rk_print_stats(P);
   }
@@ -491,10 +2335,29 @@ int main(int argc, char **argv)
 
 
 clean_exit:
-  free(mix);
+  /* Also after an error: the stats tell what happened before it */
+  lat_report(infofile ? infofile : stderr);
+  cache_end(0);
+  free(lpb.buf);
+  free(imix);
+  free(stats);
+  free(wraps);
+  for (i=0; i<ntargets; ++i) {
+    target_t * const T = targets+i;
+    while (T->nsink > 0)
+      sink_close(T->sink + --T->nsink);
+    rk_ana_free(T->ana);
+    rk_rsp_free(T->rsp);
+    free(T->mixer);
+    free(T->mix);
+  }
   free(opt_output);
-  if (aodev)
-    ao_close(aodev);
+  free(opt_cache);
+  for (i=0; i<ntees; ++i)
+    free(tees[i].uri);
+  for (i=0; i<pls.n; ++i)
+    free(pls.ent[i].path);
+  free(pls.ent);
   if (aoini)
     ao_shutdown();
 
@@ -515,6 +2378,19 @@ static long mystrtoul(char **s, const int base)
   return v;
 }
 
+/**
+ * Parse a sampling rate with an optional `k' suffix.
+ */
+static long str_rate(char **s)
+{
+  long spr = mystrtoul(s, 0);
+  if (spr != -1 && tolower(**s) == 'k') {
+    spr *= 1000u;
+    ++*s;
+  }
+  return spr;
+}
+
 /**
  * Parse -m/--mute -i/--ignore option argument. Either a string :=
  * [A-D]\+ or an integer {0..15}
@@ -535,7 +2411,42 @@ static int uint_mute(char * arg, char * name)
   } else {
     char * errp = arg;
     mute = mystrtoul(&errp, 0);
-    emsg("invalid channels -- %s=%s\n",name,arg);
+    if (mute < 0 || mute > 15 || *errp) {
+      emsg("invalid channels -- %s=%s\n",name,arg);
+      mute = -1;
+    }
   }
   return mute;
 }
+
+/**
+ * Parse -F/--filter option argument. A comma (or plus) separated list
+ * of "none", "a500", "a1200" and "led".
+ */
+static int str_filter(char * arg)
+{
+  static const char * const names[] = { "none", "a500", "a1200", "led" };
+  int flt = RK_FILTER_NONE;
+  char * s = arg;
+
+  do {
+    const int len = strcspn(s, ",+");
+    int i;
+
+    for (i=0; i<4; ++i)
+      if (len == (int) strlen(names[i]) &&
+	  !strncasecmp(s, names[i], len))
+	break;
+    if (i == 4) {
+      emsg("invalid filter -- filter=%s\n", arg);
+      return -1;
+    }
+    if (i == 3)
+      flt |= RK_FILTER_LED;
+    else
+      flt = (flt & RK_FILTER_LED) | i;
+    s += len;
+  } while (*s++);
+
+  return flt;
+}
@@ -36,12 +36,119 @@
 
 typedef struct rkpla rkpla_t;
 typedef struct rkmod rkmod_t;
+typedef struct rkmix rkmix_t;
+typedef struct rkbus rkbus_t;
+typedef struct rkana rkana_t;
+typedef struct rkrsp rkrsp_t;
+
+enum {
+  RK_INTERP_NONE, RK_INTERP_LINEAR, RK_INTERP_QUADRATIC
+};
+
+enum {
+  RK_EVT_NOTE = 1,			/* arg1:note arg2:instrument */
+  RK_EVT_INST,				/* arg1:instrument */
+  RK_EVT_ARPEGGIO,			/* arg1:arpeggio table */
+  RK_EVT_PORTAMENTO,			/* arg1:goal note arg2:speed */
+  RK_EVT_SEQUENCE,			/* arg1:repeat count */
+  RK_EVT_SONGWRAP			/* song-list wrap */
+};
+
+/* Trace event. */
+typedef struct rkevt rkevt_t;
+struct rkevt {
+  unsigned int	tic;			/* tick number */
+  unsigned int	frm;			/* frame offset of the tick */
+  unsigned char chn;			/* channel number (0-3) */
+  unsigned char typ;			/* RK_EVT_* */
+  unsigned char arg1, arg2;
+};
+
+/* Estimated output levels of a tick (rk_level). */
+typedef struct rklvl rklvl_t;
+struct rklvl {
+  int min[2], max[2];			/* extremes (left,right) */
+  double ms[2];				/* mean square */
+};
+
+/* Bus commands (rk_bus_post). */
+enum {
+  RK_CMD_PLAY = 1,			/* arg:loop */
+  RK_CMD_STOP,
+  RK_CMD_SONG,				/* arg:song number */
+  RK_CMD_MUTE,				/* arg:muted channels */
+  RK_CMD_GAIN				/* arg:gain (0x100 is unity) */
+};
+
+enum {
+  RK_FILTER_NONE, RK_FILTER_A500, RK_FILTER_A1200,
+  RK_FILTER_LED = 4			/* or'ed with the model */
+};
 
 const char * rk_version(void);
-int rk_sizeof(void);
+int rk_sizeof(const rkmod_t * M);
 int rk_init(rkpla_t * P, rkmod_t * M, int num);
+int rk_select_song(rkpla_t * P, int num);
+int rk_clone(rkpla_t * D, const rkpla_t * S, rkmod_t * M);
 int rk_play(rkpla_t * const P);
+int rk_loop(const rkpla_t * const P, unsigned * ptic);
+int rk_loop_sizeof(void);
+int rk_loop_detect(rkpla_t * const P, void * buf);
+int rk_hold(const rkpla_t * const P, int mute);
+int rk_trace(rkpla_t * const P, rkevt_t * buf, int size);
+int rk_trace_read(rkpla_t * const P, rkevt_t * evt, int max);
+int rk_stats_sizeof(void);
+int rk_stats(rkpla_t * const P, void * buf);
+int rk_interp(rkpla_t * const P, int itp);
+int rk_filter(rkpla_t * const P, int flt);
+int rk_ignore(rkpla_t * const P, int ign);
 void rk_mix(rkpla_t * P, void * mix, int ppt, int spr, int mute);
+void rk_skip(rkpla_t * P, int ppt, int spr, int mute);
+int rk_level(rkpla_t * P, rklvl_t * L, int ppt, int spr, int mute);
+int rk_mixer_sizeof(void);
+void rk_mixer_init(rkmix_t * X, const rkpla_t * P);
+void rk_mix_to(rkpla_t * P, rkmix_t * X,
+	       void * mix, int ppt, int spr, int mute);
+int rk_gain(rkpla_t * const P, int gain);
+int rk_batch_play(rkpla_t * const * P, int n, int * evt);
+void rk_batch_mix(rkpla_t * const * P, int n, void * const * mix,
+		  int ppt, int spr, int mute);
+
+int rk_bus_sizeof(int nbs);
+int rk_bus_init(rkbus_t * B, int nbs, int spr);
+int rk_bus_filter(rkbus_t * B, int flt);
+int rk_bus_attach(rkbus_t * B, int slot, rkpla_t * P);
+int rk_bus_start(rkbus_t * B, int slot, int loop);
+int rk_bus_stop(rkbus_t * B, int slot);
+int rk_bus_mute(rkbus_t * B, int slot, int mute);
+int rk_bus_gain(rkbus_t * B, int slot, int gain);
+int rk_bus_mix(rkbus_t * B, void * mix, int n);
+int rk_bus_post(rkbus_t * B, int slot, int cmd, int arg);
+int rk_bus_pos(const rkbus_t * B, int slot, unsigned * tic, unsigned * frm);
 rkmod_t * rk_load(const char * fname, int *perr);
+rkmod_t * rk_mod_dup(const rkmod_t * M);
+
+/* Analysis results. Levels are in dBFS. */
+typedef struct rkres rkres_t;
+struct rkres {
+  unsigned long frames;			/* analyzed frames */
+  unsigned long clips;			/* samples at full scale */
+  double peak;				/* sample peak */
+  double tpeak;				/* true-peak estimate (4x) */
+  double rms;				/* RMS level */
+  double lufs;				/* integrated loudness (LUFS) */
+  double rgain;				/* ReplayGain 2.0 gain (dB) */
+  unsigned long long hash;		/* content hash */
+};
+
+rkana_t * rk_ana_new(int spr);
+void rk_ana_free(rkana_t * A);
+void rk_ana_run(rkana_t * A, const void * mix, int n);
+void rk_ana_result(const rkana_t * A, rkres_t * R);
+
+rkrsp_t * rk_rsp_new(int ispr, int ospr);
+void rk_rsp_free(rkrsp_t * R);
+int rk_rsp_max(const rkrsp_t * R, int n);
+int rk_rsp_run(rkrsp_t * R, void * out, const void * in, int n);
 
 #endif /* #ifndef RKPLAY_H */
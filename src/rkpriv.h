@@ -38,6 +38,13 @@
 #include <assert.h>
 
 #define RKMAXINST 24
+#define RKMAXWRAP 24			/* loop detection checkpoints */
+#define RKBUSLEN  256			/* mix bus length (in frames) */
+#define RKBNKPAD  8			/* sample bank guard samples */
+#define RKKEYLEN  1280			/* loop detection state key bytes */
+
+/* Samples used by an instrument sample of LEN bytes in the bank. */
+#define RKBNKSEG(LEN) ( ((LEN) + 2*RKBNKPAD-1) & ~(RKBNKPAD-1) )
 
 typedef struct rkf_header rkf_hd_t;
 struct rkf_header {
@@ -89,30 +96,52 @@ struct rkf_ins {
   uint8_t xxx[7];
 };
 
+/* SID state of an instrument. */
+typedef struct rksid rksid_t;
+struct rksid {
+  int8_t   pcm;				/* I[16] */
+  uint8_t  alt;				/* I[17] */
+  int16_t  pos;				/* I[18] */
+};
+
+/* Decoded instrument. Instruments belong to the module (decoded by
+ * rk_load()) and are never altered. Addresses are offsets in the
+ * module or in its bank.
+ */
 typedef struct rk_ins rkins_t;
 struct rk_ins {
-  u8_t num;
-
-  int8_t * pcmAdr, * pcmEnd, * lpAdr, * lpEnd, * vibDat;
-  int	   vibLen, vibSpd, vibAmp, vibW8t;
-
-  i16_t	  sidSpd;
-  i16_t	  sidBas;			/* from sample def */
-  i16_t	  sidLen;			/* half len (I[A]) */
-  uint8_t sidAlt;			/* I[17] */
-  i16_t	  sidPos;			/* I[18] */
-  int8_t  sidPcm;			/* I[16] */
+  uint32_t pcm, len;			/* sample (pcm 0: none) */
+  uint32_t bnk;				/* sample in the bank */
+  uint32_t vib, vibLen;			/* vibrato table */
+  uint16_t sidBas;			/* from sample def */
+  uint32_t sbk;				/* sample in the SID bank */
+  uint8_t  num;
+  uint8_t  loop;			/* 0: one-shot sample */
+  uint8_t  sb;				/* sample altered by a SID */
+  uint8_t  vibSpd, vibAmp, vibW8t;
+
+  /* The SID alters samples. The player holds its state and its own
+   * copy of the altered samples (sb).
+   */
+  uint8_t  sidSpd;
+  uint8_t  sidLen;			/* half len (I[A]) */
+  rksid_t  sid;				/* initial state */
+
+  /* Sample levels (rk_level) */
+  int8_t   lvMin, lvMax;
+  uint32_t lvSqr;			/* sum of the squared samples */
 
   struct adsr {
     uint8_t vol, inc;
   } adsr[4];
+};
 
-  struct stat {
-    u32_t count;
-    uint16_t perMin, perMax;
-    uint16_t volMin, volMax;
-  } stats[4];
-
+/* Instrument statistics (rk_stats). */
+typedef struct rkstat rkstat_t;
+struct rkstat {
+  uint32_t count;
+  uint16_t perMin, perMax;
+  uint16_t volMin, volMax;
 };
 
 typedef struct rkmod rkmod_t;
@@ -123,6 +152,11 @@ struct rkmod {
   u8_t	nbs;
   u8_t	nba;
   u8_t	nbi;
+  int16_t * bnk;			/* sample bank */
+  u32_t bnkLen;				/* sample bank length */
+  u32_t sbkOff;				/* SID altered samples */
+  u32_t sbkLen;
+  rkins_t ins[RKMAXINST];
   uint8_t raw[1];
 };
 
@@ -133,71 +167,122 @@ struct rkf_sng {
   uint8_t rep[1];
 };
 
-typedef struct voice voice_t;
-struct voice {
-  int8_t * pcm, *end, * lpadr, * lpend;
-  u16_t vol, vtp;
-  u32_t acu, stp;
+/* Voice bank. The four Paula voices are stored lane by lane so the
+ * mixer can advance them together. Positions are offsets in the
+ * sample bank.
+ */
+typedef struct rkvoc rkvoc_t;
+struct rkvoc {
+  uint32_t pcm[4], end[4], lpadr[4], lpend[4];
+  int32_t  vol[4], vtp[4];		/* fp8 volume and ramp */
+  uint32_t acu[4], stp[4];		/* fp16 phase and step */
+  uint8_t  on;				/* playing voices */
+  uint8_t  lp;				/* looped voices */
+  uint8_t  sb;				/* voices reading the SID bank */
 };
 
+/* Channel (sequencer) state. Addresses are offsets in the module. */
 typedef struct rkchn rkchn_t;
 struct rkchn {
-  u16_t	  msk;
-  uint8_t num;
-  uint8_t trg;
-
-  uint8_t * sngAdr;
-  uint8_t * sngPtr;
-  uint8_t * seqPtr;
+  uint16_t sngAdr, sngPtr, seqPtr;	/* seqPtr 0: read a new sequence */
+  uint16_t arpAdr;
+  uint16_t msk;
 
-  rkins_t * oldIns;
-  rkins_t * curIns;
+  int16_t endPer, oldPer, curPer, ptaPer;
+  int16_t seqW8t, envW8t, sidW8t;
+  int16_t arpIdx;
+  int32_t vibIdx;
 
-  i16_t endPer, oldPer, curPer, ptaPer;
-  i16_t endVol, oldVol, curVol;
-
-  i16_t seqW8t;
+  uint8_t num;
+  uint8_t trg;
+  uint8_t oldIns, curIns;		/* instrument numbers */
+  uint8_t endVol, oldVol, curVol;
 
   uint8_t seqNot;
   uint8_t ptaNot;
   uint8_t ptaStp;
-
   uint8_t seqRep;
-
   uint8_t seqTra;
   uint8_t fx84_1;
-
-  uint8_t * arpAdr;
-  i16_t	  arpIdx;
-
   uint8_t envIdx;
   uint8_t envSpd;
+  int8_t  vibW8t;
 
-  i16_t	  envW8t;
+  uint32_t ticLen;
+};
 
-  i16_t	  sidW8t;
+typedef struct rkbiq rkbiq_t;
+struct rkbiq {
+  float b0, b1, b2, a1, a2;		/* coefficients */
+  float z1[2], z2[2];			/* state (left,right) */
+};
+
+/* Output stage (mix bus to 16-bit). */
+typedef struct rkout rkout_t;
+struct rkout {
+  uint32_t   fspr;			/* filter sampling rate */
+  uint8_t    flt;			/* output filter (RK_FILTER_*) */
+  uint8_t    nbq;			/* active biquads */
+  rkbiq_t    biq[3];			/* output filter cascade */
+};
 
-  i16_t	  vibIdx;
-  i8_t	  vibW8t;
+/* Mixer state. The player has its own, more can be attached to mix
+ * the same player at other sampling rates.
+ */
+typedef struct rkmix rkmix_t;
+struct rkmix {
+  uint32_t   spr;			/* last sampling rate used */
+  uint16_t   gain;			/* fp8 volume */
+  uint8_t    itp;			/* interpolation (RK_INTERP_*) */
+  uint8_t    act;			/* audible channels (last mix) */
+  rkvoc_t    voc;
+  rkout_t    out;
+};
+
+/* Event trace ring (single producer, single consumer). */
+typedef struct rktrc rktrc_t;
+struct rktrc {
+  struct rkevt * buf;			/* 0: disabled */
+  uint32_t	 msk;			/* size-1 (power of 2) */
+  uint32_t	 wr;			/* written by the player */
+  uint32_t	 rd;			/* written by the consumer */
+};
 
-  u32_t	  ticLen;
-  voice_t voice;
+/* Loop detection checkpoint: the player state at a wrap point. */
+typedef struct rkwrap rkwrap_t;
+struct rkwrap {
+  uint32_t   tic;			/* tick (0: none) */
+  uint32_t   len;			/* key length */
+  uint64_t   hash;			/* key hash */
+  uint8_t    key[RKKEYLEN];		/* state key */
 };
 
 typedef struct rkpla rkpla_t;
 struct rkpla {
+  /* hot: sequencer and mixer */
   rkmod_t  * mod;
   uint8_t  * raw;			/* "r.k. module */
-  rkarp_t  * arp;			/* Arpeggio table in "r.k." */
-
-  u16_t	     evt;
-  u32_t	     tic;			/* current tic */
-  u32_t	     spr;			/* last sampling rate used */
+  uint32_t   tic;			/* current tic */
+  uint32_t   frm;			/* frames mixed by own mixer */
+  uint16_t   evt;
   uint8_t    num;			/* Currenly playing */
   uint8_t    frq;			/* Tick rate */
   uint8_t    err;
-  rkins_t    ins[RKMAXINST];
+  uint8_t    ign;			/* ignored channels */
   rkchn_t    chn[4];
+  rkmix_t    mix;			/* own mixer */
+  rksid_t    sid[RKMAXINST];		/* SID state */
+
+  /* cold: loop detection, statistics and trace */
+  uint32_t   nwrap;			/* wrap points seen */
+  uint32_t   lpTic;			/* loop start tick (0:none) */
+  uint32_t   lpLen;			/* loop length in ticks */
+  rkwrap_t * wrp;			/* [RKMAXWRAP] (0: disabled) */
+  rkstat_t * sts;			/* [RKMAXINST][4] (0: disabled) */
+  rktrc_t    trc;			/* event trace */
+
+  /* SID altered samples, sized by the module (rk_sizeof()) */
+  int16_t    sbk[1];
 };
 
 #if defined __m68k__
@@ -215,4 +300,43 @@ static void * self(const uint8_t * v) {
   return (void *) ( off ? &v[off] : 0 );
 }
 
+/* Mixer bus slot. */
+typedef struct rkslot rkslot_t;
+struct rkslot {
+  rkpla_t * pla;			/* 0: free slot */
+  u32_t	    ppt;			/* frames per tick */
+  u32_t	    left;			/* frames left in this tick */
+  uint8_t   on;				/* playing */
+  uint8_t   loop;			/* keep playing at song end */
+  uint8_t   mute;			/* muted channels */
+  uint8_t   act;			/* audible channels (this tick) */
+  uint64_t  pos;			/* tick<<32 | on<<31 | frame (atomic) */
+};
+
+/* Bus command queue (bounded, multiple producers, the mixer consumes).
+ * A cell is free for the producer at position N when its sequence is
+ * N and ready for the consumer when it is N+1.
+ */
+#define RKCMDLEN 64			/* commands (power of 2) */
+
+typedef struct rkcmd rkcmd_t;
+struct rkcmd {
+  uint32_t  seq;			/* cell sequence (atomic) */
+  uint8_t   cmd;			/* RK_CMD_* */
+  uint8_t   slot;
+  int32_t   arg;
+};
+
+/* Mixer bus: players rendered into a single bus. */
+typedef struct rkbus rkbus_t;
+struct rkbus {
+  u32_t	     spr;			/* sampling rate */
+  int	     nbs;			/* number of slots */
+  rkout_t    out;
+  uint32_t   cmdWr;			/* producers position (atomic) */
+  uint32_t   cmdRd;			/* consumer position */
+  rkcmd_t    cmd[RKCMDLEN];
+  rkslot_t   slot[1];
+};
+
 #endif /* #ifndef RK_PRIV_H */
@@ -0,0 +1,288 @@
+/**
+ * @file   rkrsp.c
+ * @data   2026-10-19
+ * @author Benjamin Gerard
+ * @brief  Polyphase sample rate converter
+ *
+ * ----------------------------------------------------------------------
+ *
+ * MIT License
+ *
+ * Copyright (c) 2018 Benjamin Gerard AKA Ben^OVR.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "rkplay.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+enum {
+  RSP_TAPS   = 64,			/* taps per phase (no decimation) */
+  RSP_PHASES = 256,			/* phases when the ratio is not simple */
+  RSP_EXACT  = 1024,			/* max phases of a simple ratio */
+  RSP_CHUNK  = 1024			/* frames per pass */
+};
+
+#define RSP_CUTOFF 0.91			/* of the lower Nyquist frequency */
+#define RSP_BETA   8.0			/* Kaiser window */
+
+/* The input is kept in a float history, one per side. When the rate
+ * ratio reduces to L/M with L small enough, the filter has exactly L
+ * phases and the position advances by M/L. Otherwise the position is
+ * a 32-bit fraction and the filter phase is linearly interpolated
+ * between the two nearest of RSP_PHASES.
+ */
+struct rkrsp {
+  unsigned ispr, ospr;
+  int	   ntap;			/* taps per phase */
+  unsigned nph;				/* phases */
+  uint32_t den;				/* L (0 for 2^32) */
+  uint32_t stpf;			/* step fraction (over den) */
+  int	   stpi;			/* step integer part */
+  int	   pos;				/* next output in the history */
+  uint32_t frac;			/* and its fraction (over den) */
+  unsigned long long nin, nout;		/* frames in and out */
+  int	   len;				/* frames in the history */
+  float	 * his[2];			/* history (left,right) */
+  float	 * coef;			/* interpolated phase */
+  float	 * tab;				/* [nph+1][ntap] */
+};
+
+/* Modified Bessel function of the first kind (order 0). */
+static double
+bessel_i0(double x)
+{
+  double s = 1.0, t = 1.0;
+  int k;
+
+  for (k=1; k<32; ++k) {
+    t *= (x / (2*k)) * (x / (2*k));
+    s += t;
+  }
+  return s;
+}
+
+/* Kaiser windowed sinc. Each phase is normalized for a unity gain at
+ * DC. The taps are stored in the history order.
+ */
+static void
+rsp_setup(rkrsp_t * R)
+{
+  const double fc = RSP_CUTOFF *
+    (R->ospr < R->ispr ? (double) R->ospr / R->ispr : 1.0);
+  const double half = R->ntap / 2, i0 = bessel_i0(RSP_BETA);
+  unsigned p;
+  int k;
+
+  for (p=0; p<=R->nph; ++p) {
+    float * const h = R->tab + p * R->ntap;
+    double sum = 0;
+    for (k=0; k<R->ntap; ++k) {
+      const double x = (double) p / R->nph + half - 1 - k;
+      const double r = x / half;
+      const double w = r*r < 1.0 ? bessel_i0(RSP_BETA * sqrt(1.0-r*r)) / i0 : 0;
+      const double s = x ? sin(M_PI * fc * x) / (M_PI * fc * x) : 1.0;
+      h[k] = w * s;
+      sum += h[k];
+    }
+    for (k=0; k<R->ntap; ++k)
+      h[k] /= sum;
+  }
+}
+
+static unsigned
+gcd(unsigned a, unsigned b)
+{
+  while (b) {
+    const unsigned t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+rkrsp_t * rk_rsp_new(int ispr, int ospr)
+{
+  rkrsp_t * R;
+  unsigned g, l, m;
+  int ntap;
+
+  if (ispr < 1000 || ospr < 1000)
+    return 0;
+  /* Wider filters when decimating to keep the transition band */
+  ntap = RSP_TAPS;
+  if (ispr > ospr)
+    ntap = ( (int) ( (double) RSP_TAPS * ispr / ospr ) + 3 ) & ~3;
+
+  R = calloc(1, sizeof(*R));
+  if (!R)
+    return 0;
+  R->ispr = ispr;
+  R->ospr = ospr;
+  R->ntap = ntap;
+
+  g = gcd(ispr, ospr);
+  l = ospr / g;
+  m = ispr / g;
+  if (l <= RSP_EXACT) {
+    R->nph  = R->den = l;
+    R->stpi = m / l;
+    R->stpf = m % l;
+  } else {
+    R->nph  = RSP_PHASES;
+    R->stpi = ispr / ospr;
+    R->stpf = ( (uint64_t) (ispr % ospr) << 32 ) / ospr;
+  }
+
+  R->tab  = malloc( (R->nph+1) * ntap * sizeof(float) );
+  R->his[0] = calloc( 3 * ntap + 2 * RSP_CHUNK, sizeof(float) );
+  if (!R->tab || !R->his[0]) {
+    rk_rsp_free(R);
+    return 0;
+  }
+  R->his[1] = R->his[0] + ntap + RSP_CHUNK;
+  R->coef   = R->his[1] + ntap + RSP_CHUNK;
+  /* Centered filter: the history starts with ntap/2-1 silent frames */
+  R->len = ntap/2 - 1;
+  rsp_setup(R);
+  return R;
+}
+
+void rk_rsp_free(rkrsp_t * R)
+{
+  if (R) {
+    free(R->his[0]);
+    free(R->tab);
+    free(R);
+  }
+}
+
+int rk_rsp_max(const rkrsp_t * R, int n)
+{
+  return (int) ( ( (uint64_t) n + R->ntap ) * R->ospr / R->ispr ) + 2;
+}
+
+static inline int16_t
+clip(float v)
+{
+  const long l = lrintf(v);
+  return l < -0x8000 ? -0x8000 : l > 0x7FFF ? 0x7FFF : l;
+}
+
+/* Compute the output frames the history allows, at most MAX. */
+static int
+rsp_out(rkrsp_t * R, int16_t * out, unsigned long long max)
+{
+  const int ntap = R->ntap;
+  int n, k;
+
+  for (n=0; (unsigned long long) n < max && R->pos + ntap <= R->len; ++n) {
+    const float * const l = R->his[0] + R->pos, * const r = R->his[1] + R->pos;
+    const float * h;
+    float yl = 0, yr = 0;
+
+    if (R->den) {
+      h = R->tab + R->frac * ntap;
+      R->frac += R->stpf;
+      if (R->frac >= R->den) {
+	R->frac -= R->den;
+	++R->pos;
+      }
+    } else {
+      const float * const h0 = R->tab + (R->frac >> 24) * ntap;
+      const float * const h1 = h0 + ntap;
+      const float t = (float) (R->frac & 0xFFFFFF) / 0x1000000;
+      const uint32_t f = R->frac + R->stpf;
+      for (k=0; k<ntap; ++k)
+	R->coef[k] = h0[k] + t * (h1[k] - h0[k]);
+      h = R->coef;
+      R->pos += f < R->frac;
+      R->frac = f;
+    }
+    R->pos += R->stpi;
+
+    for (k=0; k<ntap; ++k) {
+      yl += h[k] * l[k];
+      yr += h[k] * r[k];
+    }
+    out[2*n+0] = clip(yl);
+    out[2*n+1] = clip(yr);
+  }
+  R->nout += n;
+  return n;
+}
+
+/* Convert N frames of IN (0 to flush the converter at the end of the
+ * input). Returns the number of frames written to OUT (see
+ * rk_rsp_max()).
+ */
+int rk_rsp_run(rkrsp_t * R, void * out, const void * in, int n)
+{
+  const int16_t * src = in;
+  int16_t * dst = out;
+  unsigned long long max = -1;
+  int nout = 0;
+
+  if (R->ispr == R->ospr) {
+    if (src)
+      memcpy(dst, src, n * 4);
+    return src ? n : 0;
+  }
+
+  if (!src) {
+    /* Silence past the end, up to the last frame of the input */
+    n = R->ntap;
+    max = ( R->nin * R->ospr + R->ispr - 1 ) / R->ispr - R->nout;
+  } else
+    R->nin += n;
+
+  while (n > 0) {
+    const int m = n < RSP_CHUNK ? n : RSP_CHUNK;
+    int i, used;
+
+    for (i=0; i<m; ++i) {
+      R->his[0][R->len+i] = src ? src[2*i+0] : 0;
+      R->his[1][R->len+i] = src ? src[2*i+1] : 0;
+    }
+    if (src)
+      src += 2*m;
+    R->len += m;
+    n -= m;
+    nout += rsp_out(R, dst + 2*nout, max - nout);
+
+    /* Drop the frames no longer needed */
+    used = R->pos < R->len ? R->pos : R->len;
+    for (i=0; i<2; ++i)
+      memmove(R->his[i], R->his[i]+used, (R->len-used) * sizeof(float));
+    R->len -= used;
+    R->pos -= used;
+  }
+  return nout;
+}
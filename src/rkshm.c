@@ -0,0 +1,267 @@
+/**
+ * @file   rkshm.c
+ * @data   2026-10-19
+ * @author Benjamin Gerard
+ * @brief  Shared memory PCM ring
+ *
+ * ----------------------------------------------------------------------
+ *
+ * MIT License
+ *
+ * Copyright (c) 2018 Benjamin Gerard AKA Ben^OVR.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "rkshm.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+
+#define LOAD(A)	   __atomic_load_n(A, __ATOMIC_SEQ_CST)
+#define STORE(A,V) __atomic_store_n(A, V, __ATOMIC_SEQ_CST)
+
+/* Wait for *ADR to change from VAL (or a while). */
+static void
+shm_wait(uint32_t * adr, uint32_t val)
+{
+#ifdef __linux__
+  struct timespec ts = { 0, 100000000 };
+  syscall(SYS_futex, adr, FUTEX_WAIT, val, &ts, 0, 0);
+#else
+  struct timespec ts = { 0, 1000000 };
+  if (LOAD(adr) == val)
+    nanosleep(&ts, 0);
+#endif
+}
+
+static void
+shm_wake(uint32_t * adr)
+{
+#ifdef __linux__
+  syscall(SYS_futex, adr, FUTEX_WAKE, 1, 0, 0, 0);
+#endif
+}
+
+/* Map the object FD of SIZ bytes (0: from its header). */
+static rkshm_t *
+shm_map(int fd, size_t siz)
+{
+  rkshm_t * S;
+
+  if (!siz) {
+    S = mmap(0, sizeof(*S), PROT_READ, MAP_SHARED, fd, 0);
+    if (S == MAP_FAILED)
+      return 0;
+    if (S->magic == RK_SHM_MAGIC && S->version == RK_SHM_VERSION &&
+	S->hdr >= sizeof(*S) && S->size && !(S->size & (S->size-1)))
+      siz = S->hdr + S->size;
+    munmap(S, sizeof(*S));
+    if (!siz)
+      return 0;
+  }
+  S = mmap(0, siz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  return S == MAP_FAILED ? 0 : S;
+}
+
+/* Make the calling process the producer of S. Fails (EBUSY) while
+ * another live process is.
+ */
+static int
+shm_own(rkshm_t * S)
+{
+  const uint32_t me = getpid();
+  uint32_t pid = 0;
+
+  while (!__atomic_compare_exchange_n(&S->pid, &pid, me, 0,
+				      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    /* PID is the owner: take over only if it is gone */
+    if (pid == me || !kill(pid, 0) || errno != ESRCH) {
+      errno = EBUSY;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Create the ring NAME with SIZE bytes of data (rounded up to a power
+ * of 2) or attach to it if it exists and has no producer.
+ */
+rkshm_t * rk_shm_open(const char * name, unsigned size, unsigned spr)
+{
+  rkshm_t * S = 0;
+  struct stat st;
+  unsigned siz;
+  int fd;
+
+  for (siz = 4096; siz < size; siz <<= 1)
+    ;
+  fd = shm_open(name, O_RDWR|O_CREAT, 0600);
+  if (fd == -1)
+    return 0;
+  if (!fstat(fd, &st) && st.st_size > 0)
+    S = shm_map(fd, 0);
+  else if (!ftruncate(fd, sizeof(*S) + siz) &&
+	   (S = shm_map(fd, sizeof(*S) + siz)) != 0) {
+    memset(S, 0, sizeof(*S));
+    S->version = RK_SHM_VERSION;
+    S->hdr	= sizeof(*S);
+    S->size	= siz;
+    S->chans	= 2;
+    S->bits	= 16;
+    STORE(&S->magic, RK_SHM_MAGIC);
+  }
+  close(fd);
+  if (S && shm_own(S)) {
+    rk_shm_close(S);
+    S = 0;
+  }
+  if (S) {
+    S->spr = spr;
+    STORE(&S->eof, 0);
+  }
+  return S;
+}
+
+/* Attach to the existing ring NAME. */
+rkshm_t * rk_shm_attach(const char * name)
+{
+  rkshm_t * S;
+  const int fd = shm_open(name, O_RDWR, 0);
+
+  if (fd == -1)
+    return 0;
+  S = shm_map(fd, 0);
+  close(fd);
+  return S;
+}
+
+/* Write N bytes, waiting for room as needed. Returns N. */
+int rk_shm_write(rkshm_t * S, const void * dat, int n)
+{
+  uint8_t * const buf = (uint8_t *) S + S->hdr;
+  const uint8_t * src = dat;
+  uint32_t wr = S->wr;
+  int left = n;
+
+  while (left > 0) {
+    const uint32_t rd = __atomic_load_n(&S->rd, __ATOMIC_ACQUIRE);
+    uint32_t pos = wr & (S->size-1), len = S->size - (wr - rd);
+
+    if (!len) {
+      STORE(&S->rwait, 1);
+      if (LOAD(&S->rd) == rd)
+	shm_wait(&S->rd, rd);
+      STORE(&S->rwait, 0);
+      continue;
+    }
+    if (len > S->size - pos)
+      len = S->size - pos;
+    if (len > (uint32_t) left)
+      len = left;
+    memcpy(buf+pos, src, len);
+    src  += len;
+    left -= len;
+    STORE(&S->wr, wr += len);
+    if (LOAD(&S->wwait))
+      shm_wake(&S->wr);
+  }
+  return n;
+}
+
+/* Read up to MAX bytes, waiting for some. Returns 0 at end. */
+int rk_shm_read(rkshm_t * S, void * dat, int max)
+{
+  const uint8_t * const buf = (const uint8_t *) S + S->hdr;
+  uint8_t * dst = dat;
+  uint32_t rd = S->rd;
+  int n = 0;
+
+  while (n < max) {
+    const uint32_t wr = __atomic_load_n(&S->wr, __ATOMIC_ACQUIRE);
+    uint32_t pos = rd & (S->size-1), len = wr - rd;
+
+    if (!len) {
+      if (n || LOAD(&S->eof))
+	break;
+      STORE(&S->wwait, 1);
+      if (LOAD(&S->wr) == wr && !LOAD(&S->eof))
+	shm_wait(&S->wr, wr);
+      STORE(&S->wwait, 0);
+      continue;
+    }
+    if (len > S->size - pos)
+      len = S->size - pos;
+    if (len > (uint32_t) (max - n))
+      len = max - n;
+    memcpy(dst+n, buf+pos, len);
+    n += len;
+    STORE(&S->rd, rd += len);
+    if (LOAD(&S->rwait))
+      shm_wake(&S->rd);
+  }
+  return n;
+}
+
+/* Mark the end of the stream and give up the ring. */
+void rk_shm_eof(rkshm_t * S)
+{
+  uint32_t me = getpid();
+
+  STORE(&S->eof, 1);
+  __atomic_compare_exchange_n(&S->pid, &me, 0, 0,
+			      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  shm_wake(&S->wr);
+}
+
+void rk_shm_close(rkshm_t * S)
+{
+  if (S)
+    munmap(S, S->hdr + S->size);
+}
+
+#else
+
+rkshm_t * rk_shm_open(const char * name, unsigned size, unsigned spr)
+{ return 0; }
+rkshm_t * rk_shm_attach(const char * name) { return 0; }
+int rk_shm_write(rkshm_t * S, const void * dat, int n) { return -1; }
+int rk_shm_read(rkshm_t * S, void * dat, int max) { return -1; }
+void rk_shm_eof(rkshm_t * S) { }
+void rk_shm_close(rkshm_t * S) { }
+
+#endif
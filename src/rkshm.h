@@ -0,0 +1,96 @@
+/**
+ * @file   rkshm.h
+ * @data   2026-10-19
+ * @author Benjamin Gerard
+ * @brief  Shared memory PCM ring
+ *
+ * ----------------------------------------------------------------------
+ *
+ * MIT License
+ *
+ * Copyright (c) 2018 Benjamin Gerard AKA Ben^OVR.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RKSHM_H
+#define RKSHM_H
+
+#include <stdint.h>
+
+/* A POSIX shared memory object (shm_open(3)) holding a single
+ * producer, single consumer ring of interleaved PCM frames (host
+ * endian signed 16-bit stereo). It starts with this header; the data
+ * follows at offset HDR. All fields are host endian.
+ *
+ * WR and RD are byte counters (modulo 2^32) owned by the producer and
+ * the consumer. WR-RD bytes are readable at RD%SIZE, SIZE-(WR-RD) are
+ * writable at WR%SIZE. A counter is stored (release) after the data
+ * it covers is written or read. Nothing else is needed while the ring
+ * is neither empty nor full.
+ *
+ * To sleep, a side sets its WAIT flag, loads the other counter again
+ * and, if still unchanged, waits on it with FUTEX_WAIT (not private).
+ * After storing its counter a side wakes the other one (FUTEX_WAKE on
+ * the counter) only if its WAIT flag is set. The producer sets EOF
+ * and wakes the consumer when it is done.
+ *
+ * The producer creates the object or attaches to an existing one
+ * (then keeping its size and counters). It does not unlink it. It
+ * owns the ring while PID holds its process id: another producer
+ * refuses to attach unless that process is gone. PID is cleared with
+ * EOF.
+ */
+typedef struct rkshm rkshm_t;
+struct rkshm {
+  uint32_t magic;			/* RK_SHM_MAGIC */
+  uint32_t version;			/* RK_SHM_VERSION */
+  uint32_t hdr;				/* offset of the data */
+  uint32_t size;			/* data size (power of 2) */
+  uint32_t spr;				/* sampling rate (Hz) */
+  uint16_t chans;			/* 2 */
+  uint16_t bits;			/* 16 */
+  uint32_t eof;				/* producer is done */
+  uint32_t pid;				/* producer (0: none) */
+  uint8_t  _pad0[32];
+  uint32_t wr;				/* bytes written */
+  uint32_t wwait;			/* consumer waits on WR */
+  uint8_t  _pad1[56];
+  uint32_t rd;				/* bytes read */
+  uint32_t rwait;			/* producer waits on RD */
+  uint8_t  _pad2[56];
+};
+
+#define RK_SHM_MAGIC   0x6D68736Bu	/* "kshm" little endian */
+#define RK_SHM_VERSION 1
+
+/* Producer */
+rkshm_t * rk_shm_open(const char * name, unsigned size, unsigned spr);
+int rk_shm_write(rkshm_t * S, const void * dat, int n);
+void rk_shm_eof(rkshm_t * S);
+
+/* Consumer */
+rkshm_t * rk_shm_attach(const char * name);
+int rk_shm_read(rkshm_t * S, void * dat, int max);
+
+void rk_shm_close(rkshm_t * S);
+
+#endif /* #ifndef RKSHM_H */